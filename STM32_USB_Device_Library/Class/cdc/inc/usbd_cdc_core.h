@@ -127,6 +127,8 @@ extern USBD_Class_cb_TypeDef  USBD_CDC_cb;
 /** @defgroup USB_CORE_Exported_Functions
   * @{
   */
+void usbd_cdc_Kick (uint8_t flush);
+void usbd_cdc_RxResume (void);
 /**
   * @}
   */ 
@@ -185,6 +185,13 @@ uint32_t APP_Rx_length  = 0;
 
 uint8_t  USB_Tx_State = 0;
 
+/* Device handle for transfers started outside of the USB interrupt */
+static void *cdc_pdev = NULL;
+/* Size of the last IN transfer: a full packet needs a ZLP to end it */
+static uint16_t USB_Tx_last = 0;
+/* OUT endpoint left NAKing until the interface has room again */
+static __IO uint8_t USB_Rx_Paused = 0;
+
 static uint32_t cdcCmd = 0xFF;
 static uint32_t cdcLen = 0;
 
@@ -462,6 +469,11 @@ static uint8_t  usbd_cdc_Init (void  *pdev,
                    (uint8_t*)(USB_Rx_Buffer),
                    CDC_DATA_OUT_PACKET_SIZE);
   
+  USB_Tx_State = 0;
+  USB_Tx_last = 0;
+  USB_Rx_Paused = 0;
+  cdc_pdev = pdev;
+  
   return USBD_OK;
 }
 
@@ -475,6 +487,8 @@ static uint8_t  usbd_cdc_Init (void  *pdev,
 static uint8_t  usbd_cdc_DeInit (void  *pdev, 
                                  uint8_t cfgidx)
 {
+  cdc_pdev = NULL;
+  
   /* Open EP IN */
   DCD_EP_Close(pdev,
               CDC_IN_EP);
@@ -623,38 +637,19 @@ static uint8_t  usbd_cdc_EP0_RxReady (void  *pdev)
   */
 static uint8_t  usbd_cdc_DataIn (void *pdev, uint8_t epnum)
 {
-  uint16_t USB_Tx_ptr;
-  uint16_t USB_Tx_length;
-
   if (USB_Tx_State == 1)
   {
-    if (APP_Rx_length == 0) 
-    {
-      USB_Tx_State = 0;
-    }
-    else 
+    /* Chain the next transfer right away, including data queued while
+       the last one was in flight */
+    USB_Tx_State = 0;
+    Handle_USBAsynchXfer(pdev);
+    
+    if ((USB_Tx_State == 0) && (USB_Tx_last == CDC_DATA_IN_PACKET_SIZE))
     {
-      if (APP_Rx_length > CDC_DATA_IN_PACKET_SIZE){
-        USB_Tx_ptr = APP_Rx_ptr_out;
-        USB_Tx_length = CDC_DATA_IN_PACKET_SIZE;
-        
-        APP_Rx_ptr_out += CDC_DATA_IN_PACKET_SIZE;
-        APP_Rx_length -= CDC_DATA_IN_PACKET_SIZE;    
-      }
-      else 
-      {
-        USB_Tx_ptr = APP_Rx_ptr_out;
-        USB_Tx_length = APP_Rx_length;
-        
-        APP_Rx_ptr_out += APP_Rx_length;
-        APP_Rx_length = 0;
-      }
-      
-      /* Prepare the available data buffer to be sent on IN endpoint */
-      DCD_EP_Tx (pdev,
-                 CDC_IN_EP,
-                 (uint8_t*)&APP_Rx_Buffer[USB_Tx_ptr],
-                 USB_Tx_length);
+      /* Nothing left: terminate the host transfer with a ZLP */
+      USB_Tx_State = 1;
+      USB_Tx_last = 0;
+      DCD_EP_Tx (pdev, CDC_IN_EP, NULL, 0);
     }
   }  
   
@@ -677,7 +672,12 @@ static uint8_t  usbd_cdc_DataOut (void *pdev, uint8_t epnum)
   
   /* USB data will be immediately processed, this allow next USB traffic being 
      NAKed till the end of the application Xfer */
-  APP_FOPS.pIf_DataRx(USB_Rx_Buffer, USB_Rx_Cnt);
+  if (APP_FOPS.pIf_DataRx(USB_Rx_Buffer, USB_Rx_Cnt) != USBD_OK)
+  {
+    /* No room for another packet: keep NAKing until usbd_cdc_RxResume() */
+    USB_Rx_Paused = 1;
+    return USBD_OK;
+  }
   
   /* Prepare Out endpoint to receive next packet */
   DCD_EP_PrepareRx(pdev,
@@ -688,6 +688,39 @@ static uint8_t  usbd_cdc_DataOut (void *pdev, uint8_t epnum)
   return USBD_OK;
 }
 
+/**
+  * @brief  usbd_cdc_RxResume
+  *         Re-arm the OUT endpoint held off by the interface, called from
+  *         task context once the consumer has made room
+  * @param  None
+  * @retval None
+  */
+void usbd_cdc_RxResume (void)
+{
+  if (!USB_Rx_Paused)
+  {
+    return;
+  }
+#ifdef USE_USB_OTG_HS
+  NVIC_DisableIRQ(OTG_HS_IRQn);
+#else
+  NVIC_DisableIRQ(OTG_FS_IRQn);
+#endif
+  if (USB_Rx_Paused && (cdc_pdev != NULL))
+  {
+    USB_Rx_Paused = 0;
+    DCD_EP_PrepareRx(cdc_pdev,
+                     CDC_OUT_EP,
+                     (uint8_t*)(USB_Rx_Buffer),
+                     CDC_DATA_OUT_PACKET_SIZE);
+  }
+#ifdef USE_USB_OTG_HS
+  NVIC_EnableIRQ(OTG_HS_IRQn);
+#else
+  NVIC_EnableIRQ(OTG_FS_IRQn);
+#endif
+}
+
 /**
   * @brief  usbd_audio_SOF
   *         Start Of Frame event management
@@ -699,6 +732,8 @@ static uint8_t  usbd_cdc_SOF (void *pdev)
 {      
   static uint32_t FrameCount = 0;
   
+  /* Full packets and flushes are sent by usbd_cdc_Kick(), only pick up
+     leftovers here */
   if (FrameCount++ == CDC_IN_FRAME_INTERVAL)
   {
     /* Reset the frame counter */
@@ -711,6 +746,43 @@ static uint8_t  usbd_cdc_SOF (void *pdev)
   return USBD_OK;
 }
 
+/**
+  * @brief  usbd_cdc_Kick
+  *         Start an IN transfer from task context if the endpoint is idle
+  *         and a full packet is queued, or any data at all with flush set
+  * @param  flush: send a short packet as well
+  * @retval None
+  */
+void usbd_cdc_Kick (uint8_t flush)
+{
+  uint32_t in, out, len;
+  
+#ifdef USE_USB_OTG_HS
+  NVIC_DisableIRQ(OTG_HS_IRQn);
+#else
+  NVIC_DisableIRQ(OTG_FS_IRQn);
+#endif
+  if ((cdc_pdev != NULL) && (USB_Tx_State == 0))
+  {
+    in = APP_Rx_ptr_in;
+    out = APP_Rx_ptr_out;
+    if (out == APP_RX_DATA_SIZE)
+    {
+      out = 0;
+    }
+    len = (in + APP_RX_DATA_SIZE - out) % APP_RX_DATA_SIZE;
+    if (flush ? len != 0 : len >= CDC_DATA_IN_PACKET_SIZE)
+    {
+      Handle_USBAsynchXfer(cdc_pdev);
+    }
+  }
+#ifdef USE_USB_OTG_HS
+  NVIC_EnableIRQ(OTG_HS_IRQn);
+#else
+  NVIC_EnableIRQ(OTG_FS_IRQn);
+#endif
+}
+
 /**
   * @brief  Handle_USBAsynchXfer
   *         Send data to USB
@@ -766,6 +838,7 @@ static void Handle_USBAsynchXfer (void *pdev)
       APP_Rx_length = 0;
     }
     USB_Tx_State = 1; 
+    USB_Tx_last = USB_Tx_length;
 
     DCD_EP_Tx (pdev,
                CDC_IN_EP,
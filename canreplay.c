@@ -0,0 +1,149 @@
+/*
+ * canreplay.c
+ *
+ * Convert a candump log (candump -l) into a uCAN `replay load` upload:
+ * the command line followed by the binary trace records, see
+ * inc/replay.h for the record layout.
+ *
+ *	$ stty -F /dev/ttyACM0 raw -echo
+ *	$ ./canreplay < candump.log > /dev/ttyACM0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#define MAX_FRAMES	1024	/* REPLAY_FRAMES of the F407 build */
+#define REC_SIZE	20
+
+/* struct can_frame / TIR bits */
+#define IR_IDE		0x4
+#define IR_RTR		0x2
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t len)
+{
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* "(sec.usec) iface ID#DATA" or "ID#R", returns 0 on success */
+static int parse_line(const char *line, uint64_t *us, uint8_t *rec)
+{
+	unsigned long long sec, usec;
+	char frame[64], *p, *hash;
+	uint32_t id, ir;
+	int n, dlc, h, l;
+
+	if (sscanf(line, " (%llu.%llu) %*s %63s", &sec, &usec, frame) != 3)
+		return -1;
+	hash = strchr(frame, '#');
+	if (hash == NULL || hash[1] == '#')	/* no CAN FD */
+		return -1;
+	n = hash - frame;
+	id = strtoul(frame, &p, 16);
+	if (p != hash || (n != 3 && n != 8))
+		return -1;
+	ir = n == 8 ? (id << 3) | IR_IDE : id << 21;
+
+	memset(rec, 0, REC_SIZE);
+	p = hash + 1;
+	dlc = 0;
+	if (*p == 'R') {
+		ir |= IR_RTR;
+		if (p[1] >= '0' && p[1] <= '8')
+			dlc = p[1] - '0';
+	} else {
+		while (*p && dlc < 8) {
+			if (*p == '.')
+				p++;
+			h = hexval(p[0]);
+			l = h < 0 ? -1 : hexval(p[1]);
+			if (l < 0)
+				return -1;
+			rec[12 + dlc++] = h << 4 | l;
+			p += 2;
+		}
+	}
+	*us = sec * 1000000 + usec;
+	put32(rec + 4, ir);
+	rec[8] = dlc;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[MAX_FRAMES * REC_SIZE];
+	char line[256];
+	uint64_t us, first = 0;
+	int n = 0, max = MAX_FRAMES, opt, lineno = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max = atoi(optarg);
+			if (max <= 0 || max > MAX_FRAMES)
+				max = MAX_FRAMES;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] < log > tty\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	while (n < max && fgets(line, sizeof(line), stdin)) {
+		lineno++;
+		if (parse_line(line, &us, buf + n * REC_SIZE)) {
+			fprintf(stderr, "line %d skipped\n", lineno);
+			continue;
+		}
+		if (!n)
+			first = us;
+		if (us < first || us - first > 0xffffffff) {
+			fprintf(stderr, "line %d: timestamp out of range\n",
+				lineno);
+			return 1;
+		}
+		put32(buf + n * REC_SIZE, us - first);
+		n++;
+	}
+	if (!n) {
+		fprintf(stderr, "no frames\n");
+		return 1;
+	}
+
+	printf("replay load %d %08x\r", n, crc32(0, buf, n * REC_SIZE));
+	fflush(stdout);
+	fwrite(buf, REC_SIZE, n, stdout);
+	fprintf(stderr, "%d frames, %llu ms\n", n,
+		(unsigned long long)(us - first) / 1000);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * cantrace.c
+ *
+ * Convert a uCAN `trace dump` into Chrome trace event JSON, for
+ * chrome://tracing or https://ui.perfetto.dev. Tasks and interrupts get
+ * a track each, notifications are drawn as arrows from the notifying
+ * context to the next run of the notified task. See inc/trace.h for the
+ * dump layout.
+ *
+ *	$ stty -F /dev/ttyACM0 raw -echo
+ *	$ cat /dev/ttyACM0 > trace.bin &
+ *	$ printf 'trace stop\rtrace dump\r' > /dev/ttyACM0
+ *	$ ./cantrace < trace.bin > trace.json
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EV_SIZE		8
+
+/* enum trace_type */
+#define TRACE_TASK_IN		1
+#define TRACE_TASK_OUT		2
+#define TRACE_ISR_ENTER		3
+#define TRACE_ISR_EXIT		4
+#define TRACE_QUEUE_SEND	5
+#define TRACE_QUEUE_RECV	6
+#define TRACE_NOTIFY		7
+#define TRACE_NOTIFY_TAKE	8
+#define TRACE_NOTIFY_BLOCK	9
+#define TRACE_MARK		10
+
+#define TRACE_MARK_USER		16
+
+#define PID_TASKS	1
+#define PID_IRQS	2
+
+static const char *marks[] = {"rx", "rx_take", "xmit", "tx_done"};
+
+static char *task_name[256], *irq_name[256];
+static int task_open[256], irq_open[256];
+static int flow_pending[256];	/* flow id to end at the task's next run */
+static int cur_task = -1;
+static int irq_stack[16], irq_depth;
+static int first = 1;
+
+static void emit(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void emit(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf(first ? "\n" : ",\n");
+	first = 0;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static void meta(int pid, int tid, const char *name)
+{
+	emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+	     "\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+}
+
+/* track of whatever runs now: the innermost interrupt, else the task */
+static void context(int *pid, int *tid)
+{
+	if (irq_depth) {
+		*pid = PID_IRQS;
+		*tid = irq_stack[irq_depth - 1];
+	} else {
+		*pid = PID_TASKS;
+		*tid = cur_task < 0 ? 0 : cur_task;
+	}
+}
+
+static void instant(double ts, const char *name, int data)
+{
+	int pid, tid;
+
+	context(&pid, &tid);
+	emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,"
+	     "\"ts\":%.3f,\"args\":{\"data\":%d}}", name, pid, tid, ts, data);
+}
+
+static void slice(int pid, int tid, const char *name, const char *ph,
+		  double ts)
+{
+	emit("{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,"
+	     "\"ts\":%.3f}", name, ph, pid, tid, ts);
+}
+
+static const char *tname(int n)
+{
+	static char buf[24];
+
+	if (task_name[n])
+		return task_name[n];
+	snprintf(buf, sizeof(buf), "task %d", n);
+	return buf;
+}
+
+static const char *iname(int n)
+{
+	static char buf[24];
+
+	if (irq_name[n])
+		return irq_name[n];
+	snprintf(buf, sizeof(buf), "irq %d", n);
+	return buf;
+}
+
+static void event(const uint8_t *p, double ts)
+{
+	static int flow_id;
+	char name[32];
+	int type = p[4], arg = p[5], data = p[6] | p[7] << 8;
+	int pid, tid;
+
+	switch (type) {
+	case TRACE_TASK_IN:
+		cur_task = arg;
+		if (!task_open[arg])
+			slice(PID_TASKS, arg, tname(arg), "B", ts);
+		task_open[arg] = 1;
+		if (flow_pending[arg]) {
+			emit("{\"name\":\"notify\",\"ph\":\"f\",\"bp\":\"e\","
+			     "\"id\":%d,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+			     flow_pending[arg], PID_TASKS, arg, ts);
+			flow_pending[arg] = 0;
+		}
+		break;
+	case TRACE_TASK_OUT:
+		if (task_open[arg])
+			slice(PID_TASKS, arg, tname(arg), "E", ts);
+		task_open[arg] = 0;
+		cur_task = -1;
+		break;
+	case TRACE_ISR_ENTER:
+		if (irq_depth < 16)
+			irq_stack[irq_depth++] = arg;
+		slice(PID_IRQS, arg, iname(arg), "B", ts);
+		irq_open[arg]++;
+		break;
+	case TRACE_ISR_EXIT:
+		if (irq_depth)
+			irq_depth--;
+		/* recording started inside this handler */
+		if (!irq_open[arg])
+			break;
+		slice(PID_IRQS, arg, iname(arg), "E", ts);
+		irq_open[arg]--;
+		break;
+	case TRACE_QUEUE_SEND:
+		instant(ts, "queue send", data);
+		break;
+	case TRACE_QUEUE_RECV:
+		instant(ts, "queue receive", data);
+		break;
+	case TRACE_NOTIFY:
+		snprintf(name, sizeof(name), "notify %s", tname(arg));
+		instant(ts, name, data);
+		context(&pid, &tid);
+		flow_pending[arg] = ++flow_id;
+		emit("{\"name\":\"notify\",\"ph\":\"s\",\"id\":%d,\"pid\":%d,"
+		     "\"tid\":%d,\"ts\":%.3f}", flow_id, pid, tid, ts);
+		break;
+	case TRACE_NOTIFY_TAKE:
+		instant(ts, "notify take", data);
+		break;
+	case TRACE_NOTIFY_BLOCK:
+		instant(ts, "notify wait", data);
+		break;
+	case TRACE_MARK:
+		if (arg < (int)(sizeof(marks) / sizeof(marks[0])))
+			instant(ts, marks[arg], data);
+		else if (arg >= TRACE_MARK_USER) {
+			snprintf(name, sizeof(name), "mark %d",
+				 arg - TRACE_MARK_USER);
+			instant(ts, name, data);
+		} else {
+			snprintf(name, sizeof(name), "marker %d", arg);
+			instant(ts, name, data);
+		}
+		break;
+	}
+}
+
+int main(void)
+{
+	char line[256], name[64];
+	unsigned int events, hz, bytes, i;
+	uint32_t ts, prev = 0;
+	uint64_t t = 0;
+	double last = 0;
+	uint8_t *buf;
+	int n, found = 0;
+
+	/* skip the echo and anything else before the header */
+	while (fgets(line, sizeof(line), stdin)) {
+		if (sscanf(line, "TRACE %u %u", &events, &hz) == 2 && hz) {
+			found = 1;
+			break;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "no trace header\n");
+		return 1;
+	}
+	while (fgets(line, sizeof(line), stdin)) {
+		if (sscanf(line, "T %d %63s", &n, name) == 2 && n >= 0 && n < 256)
+			task_name[n] = strdup(name);
+		else if (sscanf(line, "I %d %63s", &n, name) == 2 &&
+			 n >= 0 && n < 256)
+			irq_name[n] = strdup(name);
+		else if (sscanf(line, "DATA %u", &bytes) == 1)
+			break;
+	}
+	if (bytes != events * EV_SIZE) {
+		fprintf(stderr, "bad DATA size\n");
+		return 1;
+	}
+	buf = malloc(bytes ? bytes : 1);
+	if (buf == NULL || fread(buf, 1, bytes, stdin) != bytes) {
+		fprintf(stderr, "short trace data\n");
+		return 1;
+	}
+	if (!fgets(line, sizeof(line), stdin) ||
+	    !fgets(line, sizeof(line), stdin) || strncmp(line, "END", 3))
+		fprintf(stderr, "warning: no END after the data\n");
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	     "\"args\":{\"name\":\"tasks\"}}", PID_TASKS);
+	emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	     "\"args\":{\"name\":\"interrupts\"}}", PID_IRQS);
+	for (n = 0; n < 256; n++) {
+		if (task_name[n])
+			meta(PID_TASKS, n, task_name[n]);
+		if (irq_name[n])
+			meta(PID_IRQS, n, irq_name[n]);
+	}
+	for (i = 0; i < events; i++) {
+		const uint8_t *p = buf + i * EV_SIZE;
+
+		ts = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		/* 32-bit stamps: events must be less than one wrap apart */
+		if (i)
+			t += (uint32_t)(ts - prev);
+		prev = ts;
+		last = t * 1e6 / hz;
+		event(p, last);
+	}
+	/* close what is still running at the end of the window */
+	for (n = 0; n < 256; n++) {
+		if (task_open[n])
+			slice(PID_TASKS, n, tname(n), "E", last);
+		while (irq_open[n]-- > 0)
+			slice(PID_IRQS, n, iname(n), "E", last);
+	}
+	printf("\n]}\n");
+	fprintf(stderr, "%u events, %.3f ms\n", events, last / 1000);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * gs_usb_test.c
+ *
+ * Host unit test of the gs_usb protocol encoding in src/gs_usb.c,
+ * against a stub controller:
+ *
+ *	$ make CROSS_COMPILE= gs_usb_test && ./gs_usb_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "gs_usb.h"
+
+#define IR_IDE	0x4
+#define IR_RTR	0x2
+
+#define CHECK(c) do {							\
+	if (!(c)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);	\
+		exit(1);						\
+	}								\
+} while (0)
+
+/* what the stub controller was last asked to do */
+static struct {
+	unsigned int brp, tseg1, tseg2, sjw;
+	int bittiming, start, reset;
+	uint32_t flags;
+} hw;
+
+static int stub_bittiming(unsigned int brp, unsigned int tseg1,
+			  unsigned int tseg2, unsigned int sjw)
+{
+	hw.brp = brp;
+	hw.tseg1 = tseg1;
+	hw.tseg2 = tseg2;
+	hw.sjw = sjw;
+	hw.bittiming++;
+	return 0;
+}
+
+static int stub_start(uint32_t flags)
+{
+	hw.flags = flags;
+	hw.start++;
+	return 0;
+}
+
+static void stub_reset(void)
+{
+	hw.reset++;
+}
+
+static uint32_t stub_timestamp(void)
+{
+	return 0x12345678;
+}
+
+static const struct gs_can_ops ops = {
+	.bittiming = stub_bittiming,
+	.start = stub_start,
+	.reset = stub_reset,
+	.timestamp = stub_timestamp,
+};
+
+static const struct gs_device_bt_const bt_const = {
+	.feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_HW_TIMESTAMP,
+	.fclk_can = 42000000,
+	.tseg1_min = 1,
+	.tseg1_max = 16,
+	.tseg2_min = 1,
+	.tseg2_max = 8,
+	.sjw_max = 4,
+	.brp_min = 1,
+	.brp_max = 1024,
+	.brp_inc = 1,
+};
+
+static struct gs_can dev = {
+	.ops = &ops,
+	.bt_const = &bt_const,
+	.sw_version = 2,
+};
+
+static int mode(uint32_t m, uint32_t flags)
+{
+	struct gs_device_mode dm = {m, flags};
+
+	return gs_ctrl_out(&dev, GS_USB_BREQ_MODE, 0, &dm, sizeof(dm));
+}
+
+static int bittiming(uint32_t prop, uint32_t ph1, uint32_t ph2,
+		     uint32_t sjw, uint32_t brp)
+{
+	struct gs_device_bittiming bt = {prop, ph1, ph2, sjw, brp};
+
+	if (gs_ctrl_check(&dev, GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt)))
+		return -1;
+	return gs_ctrl_out(&dev, GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt));
+}
+
+static void test_ctrl_in(void)
+{
+	struct gs_device_config cfg;
+	struct gs_device_bt_const c;
+	uint32_t buf[16], ts;
+
+	CHECK(sizeof(cfg) == 12);
+	CHECK(sizeof(c) == 40);
+
+	memset(buf, 0xaa, sizeof(buf));
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_DEVICE_CONFIG, 1, buf,
+			 sizeof(buf)) == sizeof(cfg));
+	memcpy(&cfg, buf, sizeof(cfg));
+	CHECK(cfg.reserved1 == 0 && cfg.reserved2 == 0 && cfg.reserved3 == 0);
+	CHECK(cfg.icount == 0);
+	CHECK(cfg.sw_version == 2);
+	CHECK(cfg.hw_version == 1);
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_DEVICE_CONFIG, 0, buf,
+			 sizeof(cfg) - 1) < 0);
+
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_BT_CONST, 0, buf,
+			 sizeof(buf)) == sizeof(c));
+	CHECK(!memcmp(buf, &bt_const, sizeof(c)));
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_BT_CONST, 1, buf, sizeof(buf)) < 0);
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_BT_CONST, 0, buf,
+			 sizeof(c) - 1) < 0);
+
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_TIMESTAMP, 0, buf,
+			 sizeof(buf)) == sizeof(ts));
+	memcpy(&ts, buf, sizeof(ts));
+	CHECK(ts == 0x12345678);
+
+	CHECK(gs_ctrl_in(&dev, GS_USB_BREQ_MODE, 0, buf, sizeof(buf)) < 0);
+}
+
+static void test_ctrl_out(void)
+{
+	struct gs_host_config hc = {GS_HOST_FORMAT_LE};
+
+	CHECK(!gs_ctrl_out(&dev, GS_USB_BREQ_HOST_FORMAT, 1, &hc, sizeof(hc)));
+	hc.byte_order = 0xefbe0000;
+	CHECK(gs_ctrl_check(&dev, GS_USB_BREQ_HOST_FORMAT, 0, &hc,
+			    sizeof(hc)) < 0);
+
+	/* 500 kbit/s at 42 MHz: 6 * (1 + 11 + 2) tq */
+	CHECK(!bittiming(5, 6, 2, 1, 6));
+	CHECK(hw.bittiming == 1);
+	CHECK(hw.brp == 6 && hw.tseg1 == 11 && hw.tseg2 == 2 && hw.sjw == 1);
+
+	/* limits of bt_const, each one off by one */
+	CHECK(!bittiming(0, 1, 1, 1, 1));
+	CHECK(!bittiming(8, 8, 8, 4, 1024));
+	CHECK(bittiming(0, 0, 1, 1, 1) < 0);
+	CHECK(bittiming(8, 9, 1, 1, 1) < 0);
+	CHECK(bittiming(1, 1, 0, 1, 1) < 0);
+	CHECK(bittiming(1, 1, 9, 1, 1) < 0);
+	CHECK(bittiming(1, 1, 1, 0, 1) < 0);
+	CHECK(bittiming(1, 1, 1, 5, 1) < 0);
+	CHECK(bittiming(1, 1, 1, 1, 0) < 0);
+	CHECK(bittiming(1, 1, 1, 1, 1025) < 0);
+	CHECK(hw.bittiming == 3);
+	/* short data stage, other channel */
+	CHECK(gs_ctrl_check(&dev, GS_USB_BREQ_BITTIMING, 0, &hc,
+			    sizeof(hc)) < 0);
+	CHECK(gs_ctrl_check(&dev, GS_USB_BREQ_IDENTIFY, 1, NULL, 0) < 0);
+	CHECK(!gs_ctrl_check(&dev, GS_USB_BREQ_IDENTIFY, 0, NULL, 0));
+
+	/* modes: features beyond bt_const are refused */
+	CHECK(mode(GS_CAN_MODE_START, GS_CAN_FEATURE_LOOP_BACK) < 0);
+	CHECK(mode(2, 0) < 0);
+	CHECK(!hw.start && !dev.started);
+	CHECK(!mode(GS_CAN_MODE_START, GS_CAN_FEATURE_HW_TIMESTAMP));
+	CHECK(hw.start == 1 && dev.started);
+	CHECK(hw.flags == GS_CAN_FEATURE_HW_TIMESTAMP);
+
+	/* valid, but not while started: only gs_ctrl_out() refuses */
+	CHECK(!gs_ctrl_check(&dev, GS_USB_BREQ_MODE, 0,
+			     &(struct gs_device_mode){GS_CAN_MODE_START, 0},
+			     sizeof(struct gs_device_mode)));
+	CHECK(mode(GS_CAN_MODE_START, 0) < 0);
+	CHECK(bittiming(5, 6, 2, 1, 6) < 0);
+	CHECK(hw.start == 1 && hw.bittiming == 3);
+
+	CHECK(!mode(GS_CAN_MODE_RESET, 0));
+	CHECK(hw.reset == 1 && !dev.started);
+	CHECK(!bittiming(5, 6, 2, 1, 6));
+}
+
+static void test_frames(void)
+{
+	static const uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+	struct gs_host_frame hf;
+	uint32_t ir;
+
+	CHECK(sizeof(hf) == GS_HOST_FRAME_TS_SIZE);
+
+	/* received standard frame, no timestamps */
+	dev.flags = 0;
+	CHECK(gs_frame_encode(&dev, &hf, GS_ECHO_ID_RX, 0x123 << 21, 3,
+			      data, 77) == GS_HOST_FRAME_SIZE);
+	CHECK(hf.echo_id == GS_ECHO_ID_RX);
+	CHECK(hf.can_id == 0x123);
+	CHECK(hf.can_dlc == 3 && hf.channel == 0 && hf.flags == 0);
+	CHECK(!memcmp(hf.data, data, 3));
+	CHECK(hf.data[3] == 0);
+
+	/* TX echo keeps the host's echo_id, extended RTR, timestamps */
+	dev.flags = GS_CAN_FEATURE_HW_TIMESTAMP;
+	CHECK(gs_frame_encode(&dev, &hf, 7, 0x1abcdef0u << 3 | IR_IDE | IR_RTR,
+			      12, data, 0xdeadbeef) == GS_HOST_FRAME_TS_SIZE);
+	CHECK(hf.echo_id == 7);
+	CHECK(hf.can_id == (0x1abcdef0 | GS_CAN_EFF_FLAG | GS_CAN_RTR_FLAG));
+	CHECK(hf.can_dlc == 8);
+	CHECK(hf.data[0] == 0);
+	CHECK(hf.timestamp_us == 0xdeadbeef);
+
+	/* and back */
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) == 8);
+	CHECK(ir == (0x1abcdef0u << 3 | IR_IDE | IR_RTR));
+	hf.can_id = 0x7ff;
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) == 8);
+	CHECK(ir == 0x7ff << 21);
+
+	/* malformed ones */
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE - 1, &ir) < 0);
+	hf.can_id = 0x800;
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) < 0);
+	hf.can_id = 0x100 | GS_CAN_ERR_FLAG;
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) < 0);
+	hf.can_id = 0x100;
+	hf.can_dlc = 9;
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) < 0);
+	hf.can_dlc = 8;
+	hf.channel = 1;
+	CHECK(gs_frame_decode(&hf, GS_HOST_FRAME_SIZE, &ir) < 0);
+}
+
+int main(void)
+{
+	test_ctrl_in();
+	test_ctrl_out();
+	test_frames();
+	printf("gs_usb_test: ok\n");
+	return 0;
+}
@@ -3,7 +3,7 @@
 
 #define vPortSVCHandler SVC_Handler
 #define xPortPendSVHandler PendSV_Handler
-#define xPortSysTickHandler SysTick_Handler
+/* SysTick_Handler is in stm32f*_it.c, for the interrupt profiling */
 
 /* Here is a good place to include header files that are required across 
 your application. */
@@ -27,7 +27,7 @@ your application. */
 #define configMAX_PRIORITIES                5
 #define configMINIMAL_STACK_SIZE            100
 #define configMAX_TASK_NAME_LEN             16
-#define configUSE_TRACE_FACILITY            0
+#define configUSE_TRACE_FACILITY            1
 #define configUSE_16_BIT_TICKS              0
 #define configIDLE_SHOULD_YIELD             1
 #define configUSE_MUTEXES                   0
@@ -36,7 +36,13 @@ your application. */
 #define configUSE_ALTERNATIVE_API           0
 #define configCHECK_FOR_STACK_OVERFLOW      0
 #define configQUEUE_REGISTRY_SIZE           10
-#define configGENERATE_RUN_TIME_STATS       0
+#define configGENERATE_RUN_TIME_STATS       1
+
+/* DWT cycle counter on F407, 1 MHz timebase on F091, see prof.h */
+void prof_init();
+uint32_t prof_counter();
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()	prof_init()
+#define portGET_RUN_TIME_COUNTER_VALUE()	prof_counter()
 
 #define configUSE_CO_ROUTINES               0 
 #define configMAX_CO_ROUTINE_PRIORITIES     1
@@ -64,9 +70,12 @@ your application. */
 #define INCLUDE_vTaskDelay                      1
 #define INCLUDE_xTaskGetSchedulerState          1
 #define INCLUDE_xTaskGetCurrentTaskHandle       1
-#define INCLUDE_uxTaskGetStackHighWaterMark     0
+#define INCLUDE_uxTaskGetStackHighWaterMark     1
 #define INCLUDE_xTaskGetIdleTaskHandle          0
 #define INCLUDE_xTimerGetTimerDaemonTaskHandle  0
 #define INCLUDE_pcTaskGetTaskName               0
 #define configUSE_TASK_NOTIFICATIONS		1
+
+/* trace recorder hooks */
+#include "trace.h"
 #endif /* FREERTOS_CONFIG_H */
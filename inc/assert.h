@@ -1,4 +1,4 @@
-#include <stdio.h>
+#include "fmt.h"
 #define ASSERT(condition) if (!(condition))\
-	iprintf("ERROR @ " __FILE__ ":%d\r\n", __LINE__)
+	xprintf("ERROR @ " __FILE__ ":%d\r\n", __LINE__)
 
@@ -0,0 +1,14 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/*
+ * On-target micro-benchmarks of the firmware building blocks, reported
+ * in CPU cycles per operation. Each one runs BENCH_TRIALS times; the
+ * minimum is the undisturbed cost, median and maximum show what
+ * interrupts add.
+ */
+#define BENCH_TRIALS	15	/* odd, for the median */
+
+int bench_run(const char *name);
+
+#endif /* _BENCH_H */
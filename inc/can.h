@@ -3,8 +3,13 @@
 
 #include "FreeRTOS.h"
 #include "task.h"
+#include "filter.h"
 
-#define RX_QUEUE_LEN 100
+#define RX_QUEUE_LEN 128	/* must be a power of two */
+#define TX_QUEUE_LEN 32		/* must be a power of two */
+#define DUMP_QUEUE_LEN 64	/* must be a power of two */
+#define DUMP_BATCH 8		/* frames formatted per write */
+#define DUMP_PERIOD 10		/* ms */
 
 #ifdef TARGET_F407
 #include "stm32f4xx_can.h"
@@ -19,6 +24,8 @@
 #define CAN_RX_SOURCE              GPIO_PinSource0
 #define CAN_TX_SOURCE              GPIO_PinSource1 
 #define CAN_IRQ                    CAN1_RX0_IRQn
+#define CAN_TX_IRQ                 CAN1_TX_IRQn
+#define CAN_SCE_IRQ                CAN1_SCE_IRQn
 #endif /* TARGET_F407 */
 
 #ifdef TARGET_F091
@@ -36,21 +43,81 @@
 #define CAN_IRQ			CEC_CAN_IRQn
 #endif /* TARGET_F091 */
 
+#ifdef TARGET_F407
+#define CAN_CLK_HZ	(configCPU_CLOCK_HZ / 4)	/* APB1 */
+#endif
+#ifdef TARGET_F091
+#define CAN_CLK_HZ	configCPU_CLOCK_HZ
+#endif
+
 #define CAN_NUM_MB	3
+#define CAN_TX_NOTAG	0xffffffff	/* can_xmit_tagged(): no report */
+#define CAN_BITRATE_DFL	1000000
+
+/* can_dump_pkt() modes */
+#define CAN_DUMP_TEXT	1
+#define CAN_DUMP_SLCAN	2
+#define CAN_DUMP_TS	4	/* SLCAN: append ms timestamp */
+
+/* Received frame as laid out in the bxCAN FIFO mailbox registers */
+struct can_frame {
+	uint32_t ir;		/* RIR: STID, EXID, IDE, RTR */
+	uint32_t dtr;		/* RDTR: DLC, FMI, TIME */
+	union {
+		uint32_t dw[2];	/* RDLR, RDHR */
+		uint8_t data[8];
+	};
+	uint32_t ts;		/* timebase, us */
+};
+
+#define CAN_FRAME_STDID(f)	((f)->ir >> 21)
+#define CAN_FRAME_EXTID(f)	(((f)->ir >> 3) & 0x1fffffff)
+#define CAN_FRAME_DLC(f)	((f)->dtr & 0xf)
+/* TTCM stamp of the SOF, in bit times */
+#define CAN_FRAME_TIME(f)	((f)->dtr >> 16)
 
 extern unsigned int can_id;
+extern unsigned int can_bitrate;
 
 struct can_stat {
 	int csent, crecv, bsent, brecv;
+	int txfull, txerr, rxovr, dumpdrop;
+	int txabort;		/* cancelled in a mailbox, not bus errors */
+	uint32_t rx_ts, tx_ts;	/* last RX frame / TX completion, us */
 };
 
 void can_init();
 void can_filter_setup(unsigned int id, unsigned int mask);
-void can_xmit(unsigned int id, unsigned char *data, int len);
-int can_recv(unsigned char *msg);
+int can_xmit(unsigned int id, unsigned char *data, int len);
+int can_xmit_wait(unsigned int id, unsigned char *data, int len,
+		  TickType_t timeout, uint32_t tag);
+int can_xmit_frame(uint32_t ir, unsigned char *data, int len);
+int can_xmit_tagged(uint32_t ir, unsigned char *data, int len, uint32_t tag);
+void can_tx_notify(void (*done)(uint32_t tag, int ok, uint32_t now,
+				BaseType_t *woken));
+void can_xmit_cancel();
+void can_tx_claim(void (*done)(int mb, int ok, uint32_t now));
+void can_tx_release();
+int can_mb_stage(uint32_t ir, const uint8_t *data, int len);
+void can_mb_fire(int mb);
+int can_recv(unsigned char *msg, uint32_t *ts);
+int can_recv_frame(struct can_frame *f, TickType_t timeout);
 void can_dump_tx();
-void can_dump_pkt(int on);
+void can_dump_pkt(int mode);
+int can_set_bitrate(unsigned int bps);
+int can_set_timing(int presc, int bs1, int bs2, int sjw);
+void can_set_listen(int on);
+void can_err_irq(int on);
+int can_rx_filter_add(const struct filter_rule *r);
+int can_rx_filter_del(int idx);
+void can_rx_filter_default(int action);
+void can_rx_filter_clear();
+void can_rx_filter_get(struct filter *fl);
 void can_stat_reset();
 struct can_stat *can_stat_get();
 void can_stat_dump();
+void task_dump(void *vpars);
+int can_bench_xmit(int n, uint32_t *t);
+int can_bench_rx(const struct can_frame *f, int n, uint32_t *t);
+int can_bench_dump(const struct can_frame *f, int n, uint32_t *t);
 #endif
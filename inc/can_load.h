@@ -0,0 +1,31 @@
+#ifndef _CAN_LOAD_H
+#define _CAN_LOAD_H
+
+#include <stdint.h>
+
+/* both powers of two, the ISR path only shifts and masks */
+#define LOAD_BIN_SHIFT	11
+#define LOAD_BIN_US	(1 << LOAD_BIN_SHIFT)	/* 2.048 ms */
+#define LOAD_BINS	512			/* 1.05 s of history */
+
+/* utilisation over the last 10 ms, 100 ms and 1 s, in permille */
+struct can_load {
+	unsigned int bits[3];
+	unsigned int load[3];
+};
+
+/* the whole accounting state, for `bench` to roll back */
+struct can_load_state {
+	uint16_t bins[LOAD_BINS];
+	uint32_t bin_ts;
+};
+
+void can_load_init();
+int can_frame_bits(uint32_t ir, int dlc, const uint8_t *data);
+void can_load_save(struct can_load_state *s);
+void can_load_restore(const struct can_load_state *s);
+void can_load_add(uint32_t ts, int bits);
+void can_load_get(struct can_load *l);
+void can_load_dump();
+
+#endif /* _CAN_LOAD_H */
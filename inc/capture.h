@@ -0,0 +1,40 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include "can.h"
+
+/*
+ * Triggered capture of every received frame into a RAM ring, recorded
+ * from the RX interrupt. The F407 keeps it in the otherwise unused 64K
+ * core coupled RAM.
+ */
+#ifdef TARGET_F091
+#define CAPTURE_FRAMES	128	/* must be a power of two */
+#else
+#define CAPTURE_FRAMES	2048	/* must be a power of two, 40K of CCM */
+#endif
+
+/* struct can_frame ir bit 0 (TXRQ, unused on RX): error event, dtr = ESR */
+#define CAPTURE_ERR	1
+
+enum capture_state {
+	CAPTURE_IDLE,
+	CAPTURE_ARMED,		/* recording, waiting for the trigger */
+	CAPTURE_TRIGGERED,	/* recording the post-trigger frames */
+	CAPTURE_FROZEN,
+};
+
+void capture_trig_id(uint32_t id, uint32_t mask);
+void capture_trig_data(const uint8_t *pat, const uint8_t *mask);
+void capture_trig_err(int on);
+void capture_trig_off();
+int capture_arm(unsigned int post);
+void capture_stop();
+void capture_frame(const struct can_frame *f);
+void capture_error(uint32_t esr, uint32_t ts);
+enum capture_state capture_get_state();
+void capture_status();
+void capture_dump();
+
+#endif /* _CAPTURE_H */
@@ -0,0 +1,68 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <stdint.h>
+
+/*
+ * Software RX filter, evaluated per frame in the RX interrupt.
+ *
+ * Rules are tried in order, the first one whose expression holds decides
+ * what happens to the frame, the default action applies if none does.
+ * Expressions are compiled on the device into a bytecode without jumps,
+ * so evaluation time is bounded by FILTER_RULES * FILTER_PROG. Like the
+ * SLCAN codec this has no hardware dependencies.
+ *
+ *	expr	:= term { '|' term }
+ *	term	:= factor { '&' factor }
+ *	factor	:= '!' factor | '(' expr ')' | test
+ *	test	:= ext | rtr
+ *		 | id OP HEX | id = HEX-HEX
+ *		 | dlc OP HEX
+ *		 | bN[/MASK] OP HEX		payload byte N, 0..7
+ *	OP	:= = != < > <= >=
+ *
+ * e.g. "id = 100-1ff & !rtr", "b0/f0 = 20 | ext"
+ */
+
+#ifdef TARGET_F091
+#define FILTER_RULES	4
+#else
+#define FILTER_RULES	8
+#endif
+#define FILTER_PROG	32	/* bytecode per rule */
+#define FILTER_SRC	48	/* expression text kept for listing */
+#define FILTER_STACK	16	/* evaluation stack, bits */
+
+/* actions, a bit mask */
+#define FILTER_QUEUE	1	/* task RX ring, dump */
+#define FILTER_CAPTURE	2	/* capture ring */
+#define FILTER_COUNT	0	/* only count the hit: drop */
+
+#define FILTER_EXT	1	/* filter_run() flags */
+#define FILTER_RTR	2
+
+struct filter_rule {
+	uint8_t len, action;
+	uint8_t prog[FILTER_PROG];
+	char src[FILTER_SRC];
+	uint32_t hits;
+};
+
+struct filter {
+	int nrules;
+	uint8_t dfl;		/* default action */
+	uint32_t dfl_hits;
+	struct filter_rule rule[FILTER_RULES];
+};
+
+void filter_init(struct filter *fl);
+int filter_compile(const char *src, uint8_t *prog, int size);
+int filter_rule_init(struct filter_rule *r, int action, const char *src);
+int filter_add(struct filter *fl, const struct filter_rule *r);
+int filter_del(struct filter *fl, int idx);
+int filter_eval(const uint8_t *prog, int len, uint32_t id, int flags,
+		int dlc, const uint8_t *data);
+int filter_run(struct filter *fl, uint32_t id, int flags, int dlc,
+	       const uint8_t *data);
+
+#endif /* _FILTER_H */
@@ -0,0 +1,26 @@
+#ifndef _FLOOD_H
+#define _FLOOD_H
+
+#define FLOOD_MAX_IDS	16
+#define FLOOD_MAX_DLCS	9
+#define FLOOD_TICK_HZ	10000	/* pacing timer rate */
+
+enum flood_pattern {
+	FLOOD_COUNTER,
+	FLOOD_CONST,
+	FLOOD_RANDOM,
+};
+
+enum flood_mode {
+	FLOOD_MAX,	/* keep the TX queue full */
+	FLOOD_FPS,	/* frames per second */
+	FLOOD_LOAD,	/* bus load, permille */
+};
+
+int flood_set_ids(char *list);
+int flood_set_dlcs(char *list);
+void flood_set_pattern(enum flood_pattern p, unsigned char val);
+void flood_dump_config();
+void flood_run(enum flood_mode mode, unsigned int rate, unsigned int ms);
+
+#endif /* _FLOOD_H */
@@ -0,0 +1,37 @@
+#ifndef _FMT_H
+#define _FMT_H
+
+#include <stdint.h>
+#include <stdarg.h>
+
+/*
+ * Small integer-only formatter used instead of newlib stdio on the
+ * console and diagnostic paths. Does not allocate and needs no more than
+ * a few dozen bytes of stack on top of the XPRINTF_BUF output buffer.
+ *
+ * Supported: %d %i %u %x %X %c %s %p %%, flags '-' and '0', field width.
+ * 'l' and 'h' length modifiers are accepted and ignored (int is 32 bit).
+ * No floating point, no precision.
+ *
+ * Decimal conversion subtracts powers of ten, so the Cortex-M0 never
+ * calls into the libgcc divider.
+ */
+
+/* xprintf() flushes to the console every this many bytes */
+#define XPRINTF_BUF	64
+
+int xvsnprintf(char *buf, unsigned int size, const char *fmt, va_list ap);
+int xsnprintf(char *buf, unsigned int size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int xprintf(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+int xwrite(const char *buf, int len);
+int xputs(const char *s);
+int xputc(int c);
+int xgetc(void);
+
+/* fast paths, no terminating NUL; return the number of characters */
+int fmt_hex(char *buf, uint32_t v, int digits);
+int fmt_udec(char *buf, uint32_t v);
+
+#endif /* _FMT_H */
@@ -0,0 +1,126 @@
+#ifndef _GS_USB_H
+#define _GS_USB_H
+
+#include <stdint.h>
+
+/*
+ * gs_usb (candleLight) host protocol, as spoken by the Linux gs_usb
+ * driver. Encoding only, no hardware dependencies: builds on a host.
+ * All multi-byte fields are little-endian on the wire, as on both ends.
+ */
+
+#define GS_USB_VID		0x1d50
+#define GS_USB_PID		0x606f
+
+/* vendor requests, bRequest */
+enum gs_usb_breq {
+	GS_USB_BREQ_HOST_FORMAT = 0,
+	GS_USB_BREQ_BITTIMING,
+	GS_USB_BREQ_MODE,
+	GS_USB_BREQ_BERR,
+	GS_USB_BREQ_BT_CONST,
+	GS_USB_BREQ_DEVICE_CONFIG,
+	GS_USB_BREQ_TIMESTAMP,
+	GS_USB_BREQ_IDENTIFY,
+};
+
+#define GS_CAN_MODE_RESET	0
+#define GS_CAN_MODE_START	1
+
+/* gs_device_mode.flags and gs_device_bt_const.feature */
+#define GS_CAN_FEATURE_LISTEN_ONLY	(1 << 0)
+#define GS_CAN_FEATURE_LOOP_BACK	(1 << 1)
+#define GS_CAN_FEATURE_TRIPLE_SAMPLE	(1 << 2)
+#define GS_CAN_FEATURE_ONE_SHOT		(1 << 3)
+#define GS_CAN_FEATURE_HW_TIMESTAMP	(1 << 4)
+
+/* gs_host_frame.can_id, as Linux canid_t */
+#define GS_CAN_EFF_FLAG		0x80000000
+#define GS_CAN_RTR_FLAG		0x40000000
+#define GS_CAN_ERR_FLAG		0x20000000
+
+/* gs_host_frame.flags */
+#define GS_CAN_FLAG_OVERFLOW	(1 << 0)
+
+/* echo_id of frames received from the bus */
+#define GS_ECHO_ID_RX		0xffffffff
+
+#define GS_HOST_FORMAT_LE	0x0000beef
+
+struct gs_host_config {
+	uint32_t byte_order;
+};
+
+struct gs_device_config {
+	uint8_t reserved1, reserved2, reserved3;
+	uint8_t icount;		/* number of channels - 1 */
+	uint32_t sw_version;
+	uint32_t hw_version;
+};
+
+struct gs_device_mode {
+	uint32_t mode;
+	uint32_t flags;
+};
+
+struct gs_device_bittiming {
+	uint32_t prop_seg;
+	uint32_t phase_seg1;
+	uint32_t phase_seg2;
+	uint32_t sjw;
+	uint32_t brp;
+};
+
+struct gs_device_bt_const {
+	uint32_t feature;
+	uint32_t fclk_can;
+	uint32_t tseg1_min, tseg1_max;
+	uint32_t tseg2_min, tseg2_max;
+	uint32_t sjw_max;
+	uint32_t brp_min, brp_max, brp_inc;
+};
+
+struct gs_host_frame {
+	uint32_t echo_id;
+	uint32_t can_id;
+	uint8_t can_dlc;
+	uint8_t channel;
+	uint8_t flags;
+	uint8_t reserved;
+	uint8_t data[8];
+	uint32_t timestamp_us;	/* only with GS_CAN_FEATURE_HW_TIMESTAMP */
+};
+
+#define GS_HOST_FRAME_SIZE	20
+#define GS_HOST_FRAME_TS_SIZE	24
+
+struct gs_can_ops {
+	/* tseg1 = prop_seg + phase_seg1, in tq */
+	int (*bittiming)(unsigned int brp, unsigned int tseg1,
+			 unsigned int tseg2, unsigned int sjw);
+	int (*start)(uint32_t flags);
+	void (*reset)(void);
+	uint32_t (*timestamp)(void);
+};
+
+struct gs_can {
+	const struct gs_can_ops *ops;
+	const struct gs_device_bt_const *bt_const;
+	uint32_t sw_version;
+	int started;
+	uint32_t flags;		/* GS_CAN_FEATURE_* of the running mode */
+};
+
+int gs_ctrl_in(struct gs_can *d, uint8_t req, uint16_t wvalue,
+	       void *buf, int len);
+int gs_ctrl_check(const struct gs_can *d, uint8_t req, uint16_t wvalue,
+		  const void *buf, int len);
+int gs_ctrl_out(struct gs_can *d, uint8_t req, uint16_t wvalue,
+		const void *buf, int len);
+int gs_frame_size(const struct gs_can *d);
+int gs_frame_encode(const struct gs_can *d, struct gs_host_frame *hf,
+		    uint32_t echo_id, uint32_t ir, int dlc,
+		    const uint8_t *data, uint32_t ts);
+int gs_frame_decode(const struct gs_host_frame *hf, int len, uint32_t *ir);
+
+#endif /* _GS_USB_H */
@@ -0,0 +1,35 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-bucketed (HDR-style) histogram of 32-bit samples.
+ *
+ * Values below 2^HIST_SUB_BITS get a bucket each, every following
+ * power-of-two range is split into 2^(HIST_SUB_BITS - 1) buckets, so the
+ * relative bucket width is bounded by 2^-(HIST_SUB_BITS - 1).
+ */
+#ifdef TARGET_F091
+#define HIST_SUB_BITS	4	/* 12.5% */
+#else
+#define HIST_SUB_BITS	5	/* 6.25% */
+#endif
+#define HIST_HALF	(1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS	((32 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+struct hist {
+	uint32_t bucket[HIST_BUCKETS];
+	uint32_t count, min, max, last;
+	uint64_t sum;
+	uint64_t jsum;		/* sum of |sample - previous sample| */
+};
+
+void hist_reset(struct hist *h);
+void hist_add(struct hist *h, uint32_t v);
+uint32_t hist_bucket_low(int idx);
+uint32_t hist_quantile(struct hist *h, uint32_t num, uint32_t den);
+uint32_t hist_mean(struct hist *h);
+uint32_t hist_jitter(struct hist *h);
+
+#endif /* _HIST_H */
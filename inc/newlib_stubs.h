@@ -1,9 +1,26 @@
+#ifndef _NEWLIB_STUBS_H
+#define _NEWLIB_STUBS_H
+
 #include <sys/unistd.h>
+#include "FreeRTOS.h"
+#include "ring.h"
 
+/* must be a power of two */
+#ifdef TARGET_F091
+#define STDIN_BUFFER_SIZE 256
+#else
 #define STDIN_BUFFER_SIZE 1024
+#endif
+
+/* console input: USB OUT packets or USART RX DMA -> _read() */
+RING_DECLARE(stdin_ring, uint8_t, STDIN_BUFFER_SIZE);
 
 #ifndef __NEWLIB_STUBS
-extern volatile uint8_t stdin_buffer[];
-extern volatile uint16_t stdin_buffer_in;
-extern volatile uint16_t stdin_buffer_len;
+extern struct stdin_ring stdin_ring;
 #endif
+
+void stdin_wakeup_from_isr(BaseType_t *woken);
+int stdin_read(char *ptr, int len, TickType_t timeout);
+void stdin_drop(int n);
+
+#endif /* _NEWLIB_STUBS_H */
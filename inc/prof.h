@@ -0,0 +1,138 @@
+#ifndef _PROF_H
+#define _PROF_H
+
+#include <stdint.h>
+#include "FreeRTOS.h"
+#include "timebase.h"
+#include "trace.h"
+
+/*
+ * Time base of the FreeRTOS run-time statistics and of the interrupt
+ * accounting: the DWT cycle counter on the F407, the 1 MHz timebase on
+ * the F091, whose Cortex-M0 has no cycle counter. 32 bits, wraps every
+ * 25 s on the F407; only differences are meaningful.
+ */
+#ifdef TARGET_F407
+#define PROF_HZ		configCPU_CLOCK_HZ
+#define PROF_HIST_SHIFT	8	/* histogram: <256, <512, .. >=16K cycles */
+#define PROF_TOP_MAX_MS	20000	/* `top` period, well inside one wrap */
+
+/* not in this CMSIS version */
+#define PROF_DWT_CTRL	(*(volatile uint32_t *)0xe0001000)
+#define PROF_DWT_CYCCNT	(*(volatile uint32_t *)0xe0001004)
+#define PROF_DWT_CYCCNTENA	1
+
+static inline uint32_t prof_now()
+{
+	return PROF_DWT_CYCCNT;
+}
+#endif
+
+#ifdef TARGET_F091
+#define PROF_HZ		1000000
+#define PROF_HIST_SHIFT	1	/* histogram: <2, <4, .. >=128 us */
+#define PROF_TOP_MAX_MS	3600000
+
+static inline uint32_t prof_now()
+{
+	return timebase_now();
+}
+#endif
+
+#define PROF_TASKS	12	/* `top` slots */
+#define PROF_HIST	8
+
+/* instrumented interrupt handlers */
+enum prof_irq {
+#ifdef TARGET_F407
+	PROF_IRQ_CAN_RX,
+	PROF_IRQ_CAN_TX,
+	PROF_IRQ_CAN_SCE,
+	PROF_IRQ_USB,
+#endif
+#ifdef TARGET_F091
+	PROF_IRQ_CAN,		/* one vector for RX, TX and errors */
+	PROF_IRQ_DMA,		/* console */
+	PROF_IRQ_USART,
+#endif
+	PROF_IRQ_TICK,
+	PROF_IRQ_TIMEBASE,
+	PROF_IRQ_FLOOD,
+	PROF_IRQS,
+};
+
+/*
+ * Per handler, entry to exit of its C body: hardware stacking and
+ * tail-chaining are not seen, interrupts nested inside are included.
+ */
+struct prof_irq_stat {
+	uint32_t count;
+	uint32_t nest;		/* entered while preempting another handler */
+	uint32_t min, max;
+	uint64_t total;
+	uint32_t hist[PROF_HIST];
+};
+
+/* time spent in instrumented interrupts, outermost entry to exit */
+struct prof_isr {
+	volatile uint32_t time;
+	uint32_t t0;
+	int depth;
+	struct prof_irq_stat irq[PROF_IRQS];
+};
+extern struct prof_isr prof_isr;
+extern const char *const prof_irq_names[PROF_IRQS];
+
+/* ISR prologue, returns the entry time for prof_isr_exit() */
+static inline uint32_t prof_isr_enter(int irq)
+{
+	uint32_t pm = __get_PRIMASK(), t;
+
+	__disable_irq();
+	t = prof_now();
+	if (prof_isr.depth++)
+		prof_isr.irq[irq].nest++;
+	else
+		prof_isr.t0 = t;
+	__set_PRIMASK(pm);
+	TRACE(TRACE_ISR_ENTER, irq, 0);
+	return t;
+}
+
+/* ISR epilogue; nested interrupts are counted once in the total */
+static inline void prof_isr_exit(int irq, uint32_t t0)
+{
+	struct prof_irq_stat *s = &prof_isr.irq[irq];
+	uint32_t pm = __get_PRIMASK(), t, dt;
+	int b;
+
+	TRACE(TRACE_ISR_EXIT, irq, 0);
+	__disable_irq();
+	t = prof_now();
+	dt = t - t0;
+	if (!--prof_isr.depth)
+		prof_isr.time += t - prof_isr.t0;
+	__set_PRIMASK(pm);
+
+	/* a handler does not preempt itself: no lock for its own slot */
+	b = 31 - __builtin_clz(dt | 1) - (PROF_HIST_SHIFT - 1);
+	if (b < 0)
+		b = 0;
+	if (b >= PROF_HIST)
+		b = PROF_HIST - 1;
+	s->hist[b]++;
+	if (!s->count++ || dt < s->min)
+		s->min = dt;
+	if (dt > s->max)
+		s->max = dt;
+	s->total += dt;
+}
+
+void prof_init();
+uint32_t prof_counter();
+void prof_top_reset();
+void prof_top();
+void prof_isr_reset();
+void prof_isr_dump();
+
+#endif /* _PROF_H */
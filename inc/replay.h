@@ -0,0 +1,35 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stdint.h>
+
+#ifdef TARGET_F091
+#define REPLAY_FRAMES	128
+#else
+#define REPLAY_FRAMES	1024
+#endif
+
+#define REPLAY_LOAD_TIMEOUT	1000	/* ticks without input */
+#define REPLAY_LEAD_US		1000	/* first frame after `replay run` */
+
+/*
+ * Trace record as uploaded by the host (little endian, 20 bytes), see
+ * canreplay.c for the candump log converter.
+ */
+struct replay_rec {
+	uint32_t ts;		/* us since the first frame, non-decreasing */
+	uint32_t ir;		/* TIR layout: STID or EXID, IDE, RTR */
+	uint8_t dlc;
+	uint8_t pad;
+	uint16_t dur;		/* sent as 0: on-wire time, us, see replay_load() */
+	uint8_t data[8];
+};
+
+int replay_load(unsigned int n, uint32_t crc);
+int replay_start(unsigned int speed);
+void replay_stop();
+int replay_running();
+void replay_dump();
+void replay_stat_dump();
+
+#endif /* _REPLAY_H */
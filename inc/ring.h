@@ -0,0 +1,46 @@
+#ifndef _RING_H
+#define _RING_H
+
+/*
+ * Single-producer/single-consumer lock-free ring.
+ *
+ * `in` is written by the producer only, `out` by the consumer only, so an
+ * ISR and a task can share a ring without masking interrupts. Indices run
+ * freely and are masked on access, hence the power-of-two size.
+ *
+ *	RING_DECLARE(rx_ring, CanRxMsg, 128);
+ *	static struct rx_ring rx;
+ *
+ * Producer:			Consumer:
+ *	if (!ring_full(&rx)) {		if (!ring_empty(&rx)) {
+ *		fill(ring_head(&rx));		use(ring_tail(&rx));
+ *		ring_push(&rx);			ring_pop(&rx);
+ *	}				}
+ */
+
+#define RING_DECLARE(name, type, size)					\
+struct name {								\
+	volatile unsigned int in, out;					\
+	type buf[size];							\
+};									\
+_Static_assert(((size) & ((size) - 1)) == 0,				\
+	       #name ": size must be a power of two")
+
+/* keep slot accesses on the right side of the index update */
+#define ring_barrier()	__asm__ __volatile__("" ::: "memory")
+
+#define ring_init(r)	((r)->in = (r)->out = 0)
+#define ring_size(r)	(sizeof((r)->buf) / sizeof((r)->buf[0]))
+#define ring_len(r)	((r)->in - (r)->out)
+#define ring_empty(r)	((r)->in == (r)->out)
+#define ring_full(r)	(ring_len(r) >= ring_size(r))
+
+/* producer: next free slot, then publish it */
+#define ring_head(r)	(&(r)->buf[(r)->in & (ring_size(r) - 1)])
+#define ring_push(r)	do { ring_barrier(); (r)->in++; } while (0)
+
+/* consumer: oldest element, then release it */
+#define ring_tail(r)	(&(r)->buf[(r)->out & (ring_size(r) - 1)])
+#define ring_pop(r)	do { ring_barrier(); (r)->out++; } while (0)
+
+#endif /* _RING_H */
@@ -0,0 +1,69 @@
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include <stdint.h>
+
+/*
+ * On-device command scripting for the CLI:
+ *
+ *	cmd [; cmd ...]			command list
+ *	repeat N { list }		N times, 0 repeats until aborted
+ *	def NAME { list }		store a macro, NAME then runs it
+ *	undef NAME
+ *	usleep US			wait US microseconds
+ *
+ * Delays are not relative to the preceding command. Each usleep advances
+ * a schedule that starts when the line is entered, so command execution
+ * time does not accumulate and a step that ran late is caught up by the
+ * following one. Like the SLCAN codec this has no hardware dependencies,
+ * time and command execution are provided through struct script_ops.
+ */
+
+#define SCRIPT_LINE	256	/* longest simple command */
+#define SCRIPT_DEPTH	4	/* repeat / macro nesting */
+#ifdef TARGET_F091
+#define SCRIPT_MACROS	4
+#define SCRIPT_BODY	96
+#else
+#define SCRIPT_MACROS	8
+#define SCRIPT_BODY	192
+#endif
+#define SCRIPT_NAME	12
+
+/* script_run() return values, command errors are passed through */
+#define SCRIPT_OK	0
+#define SCRIPT_ESYNTAX	(-1)
+#define SCRIPT_EABORT	(-2)
+#define SCRIPT_ENOMEM	(-3)
+
+struct script_ops {
+	/* run one simple command, nonzero stops the script */
+	int (*exec)(char *cmd);
+	/* free-running microseconds */
+	uint32_t (*now)(void);
+	/* return at time `t` as exactly as possible */
+	void (*wait_until)(uint32_t t);
+	/*
+	 * polled by repeat and after usleep, nonzero aborts; not before
+	 * plain commands, their input (e.g. an upload) may follow the line
+	 */
+	int (*abort)(void);
+};
+
+struct script_macro {
+	char name[SCRIPT_NAME];
+	char body[SCRIPT_BODY];
+};
+
+struct script {
+	const struct script_ops *ops;
+	uint32_t t;		/* schedule, us */
+	struct script_macro macro[SCRIPT_MACROS];
+	char line[SCRIPT_LINE];
+};
+
+void script_init(struct script *sc, const struct script_ops *ops);
+int script_run(struct script *sc, const char *text);
+const struct script_macro *script_macro(struct script *sc, int idx);
+
+#endif /* _SCRIPT_H */
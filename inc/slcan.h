@@ -0,0 +1,41 @@
+#ifndef _SLCAN_H
+#define _SLCAN_H
+
+#include <stdint.h>
+
+/*
+ * SLCAN (Lawicel) protocol codec. Has no hardware dependencies and
+ * builds on a Linux host as well, the device specific actions are
+ * provided through struct slcan_ops.
+ */
+
+#define SLCAN_MTU	32	/* "T" + 8 ID + DLC + 16 data + 4 stamp + CR */
+
+struct slcan_frame {
+	uint32_t id;
+	uint8_t ext, rtr, dlc;
+	uint8_t data[8];
+};
+
+struct slcan_ops {
+	int (*open)(int listen, int timestamp);
+	int (*close)(void);
+	int (*bitrate)(unsigned int bps);
+	int (*xmit)(const struct slcan_frame *f);
+};
+
+struct slcan {
+	const struct slcan_ops *ops;
+	int open, timestamp;
+	unsigned int bitrate;
+	int pos;
+	char line[SLCAN_MTU];
+};
+
+void slcan_init(struct slcan *s, const struct slcan_ops *ops);
+int slcan_input(struct slcan *s, char c, char *reply);
+int slcan_command(struct slcan *s, const char *cmd, char *reply);
+int slcan_parse_frame(const char *cmd, struct slcan_frame *f);
+int slcan_format_frame(char *buf, const struct slcan_frame *f, int ts_ms);
+
+#endif /* _SLCAN_H */
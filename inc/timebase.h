@@ -0,0 +1,34 @@
+#ifndef _TIMEBASE_H
+#define _TIMEBASE_H
+
+#include <stdint.h>
+#include "FreeRTOS.h"
+
+#ifdef TARGET_F407
+#include "stm32f4xx.h"
+
+#define TIMEBASE_CLK_HZ		(configCPU_CLOCK_HZ / 2)	/* APB1 x 2 */
+#endif
+
+#ifdef TARGET_F091
+#include "stm32f0xx.h"
+
+#define TIMEBASE_CLK_HZ		configCPU_CLOCK_HZ
+#endif
+
+/* Free-running 1 MHz timebase on the 32-bit TIM2 of both targets */
+#define TIMEBASE_TIM		TIM2
+#define TIMEBASE_IRQ		TIM2_IRQn
+
+void timebase_init();
+uint64_t timebase_now64();
+void timebase_alarm(uint32_t t, void (*fn)(void));
+void timebase_alarm_cancel();
+
+/* microseconds, wraps every ~71 minutes; use unsigned differences */
+static inline uint32_t timebase_now()
+{
+	return TIMEBASE_TIM->CNT;
+}
+
+#endif /* _TIMEBASE_H */
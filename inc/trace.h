@@ -0,0 +1,87 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Kernel trace recorder: context switches, interrupt entry and exit,
+ * queue operations, task notifications and markers, recorded with
+ * prof_now() stamps into a RAM ring that keeps the latest TRACE_EVENTS.
+ * `trace dump` sends it in binary, the host tool cantrace.c turns that
+ * into Chrome trace JSON. Included from FreeRTOSConfig.h: no FreeRTOS
+ * headers here.
+ */
+#ifdef TARGET_F091
+#define TRACE_EVENTS	256	/* must be a power of two */
+#else
+#define TRACE_EVENTS	2048	/* must be a power of two, 16K of CCM */
+#endif
+
+enum trace_type {
+	TRACE_TASK_IN = 1,	/* arg: task number */
+	TRACE_TASK_OUT,
+	TRACE_ISR_ENTER,	/* arg: enum prof_irq */
+	TRACE_ISR_EXIT,
+	TRACE_QUEUE_SEND,	/* data: queue address, low half */
+	TRACE_QUEUE_RECV,
+	TRACE_NOTIFY,		/* arg: notified task, data: its new value */
+	TRACE_NOTIFY_TAKE,	/* arg: task, data: value taken */
+	TRACE_NOTIFY_BLOCK,	/* arg: task, going to wait */
+	TRACE_MARK,		/* arg: marker, data: value */
+	TRACE_TYPES,
+};
+
+#define TRACE_ALL	((1 << TRACE_TYPES) - 2)
+
+/* TRACE_MARK markers; `trace mark N` is TRACE_MARK_USER + N */
+#define TRACE_MARK_RX		0	/* RX ISR queued a frame, data: STID */
+#define TRACE_MARK_RX_TAKE	1	/* a task dequeued it, data: STID */
+#define TRACE_MARK_XMIT		2	/* frame queued for TX, data: STID */
+#define TRACE_MARK_TX_DONE	3	/* mailbox completed, data: mailbox */
+#define TRACE_MARK_USER		16
+
+struct trace_event {
+	uint32_t ts;		/* prof_now() */
+	uint8_t type;
+	uint8_t arg;
+	uint16_t data;
+};
+
+/* one bit per recorded enum trace_type, 0 while stopped */
+extern volatile uint32_t trace_mask;
+
+void trace_event(int type, int arg, int data);
+
+#define TRACE(type, arg, data)						\
+	do {								\
+		if (trace_mask & (1 << (type)))				\
+			trace_event(type, arg, data);			\
+	} while (0)
+
+void trace_start(uint32_t mask);
+void trace_stop();
+void trace_status();
+int trace_dump();
+
+/* FreeRTOS hooks, expanded inside tasks.c and queue.c */
+#define traceTASK_SWITCHED_IN()						\
+	TRACE(TRACE_TASK_IN, pxCurrentTCB->uxTCBNumber, 0)
+#define traceTASK_SWITCHED_OUT()					\
+	TRACE(TRACE_TASK_OUT, pxCurrentTCB->uxTCBNumber, 0)
+#define traceTASK_NOTIFY()						\
+	TRACE(TRACE_NOTIFY, pxTCB->uxTCBNumber, pxTCB->ulNotifiedValue)
+#define traceTASK_NOTIFY_FROM_ISR()	traceTASK_NOTIFY()
+#define traceTASK_NOTIFY_GIVE_FROM_ISR()	traceTASK_NOTIFY()
+#define traceTASK_NOTIFY_TAKE()						\
+	TRACE(TRACE_NOTIFY_TAKE, pxCurrentTCB->uxTCBNumber,		\
+	      pxCurrentTCB->ulNotifiedValue)
+#define traceTASK_NOTIFY_TAKE_BLOCK()					\
+	TRACE(TRACE_NOTIFY_BLOCK, pxCurrentTCB->uxTCBNumber, 0)
+#define traceQUEUE_SEND(q)						\
+	TRACE(TRACE_QUEUE_SEND, 0, (uintptr_t)(q))
+#define traceQUEUE_SEND_FROM_ISR(q)	traceQUEUE_SEND(q)
+#define traceQUEUE_RECEIVE(q)						\
+	TRACE(TRACE_QUEUE_RECV, 0, (uintptr_t)(q))
+#define traceQUEUE_RECEIVE_FROM_ISR(q)	traceQUEUE_RECEIVE(q)
+
+#endif /* _TRACE_H */
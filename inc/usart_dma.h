@@ -0,0 +1,19 @@
+#ifndef _USART_DMA_H
+#define _USART_DMA_H
+
+#include <stdint.h>
+
+/* F091 console: USART2 with DMA in both directions */
+
+#define USART_BAUD_DFL		115200
+#define USART_TX_BUF_LEN	512	/* must be a power of two */
+#define USART_RX_DMA_LEN	64	/* drained at half and full, and on idle line */
+
+extern uint32_t usart_rx_dropped;
+
+void usart_dma_init(unsigned int baud);
+int usart_dma_write(const char *buf, int len);
+void usart_dma_wait(void);
+int usart_set_baud(unsigned int baud);
+
+#endif /* _USART_DMA_H */
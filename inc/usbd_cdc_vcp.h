@@ -8,5 +8,11 @@
 #define OTHER_CONFIG                    1
 
 uint16_t VCP_DataTx(uint8_t* Buf);
+uint32_t VCP_Write(const uint8_t *buf, uint32_t len);
+uint32_t VCP_WriteSpace(void);
+void VCP_Flush(void);
+void VCP_RxResume(void);
+
+extern uint32_t VCP_tx_dropped;
 
 #endif /* __USBD_CDC_VCP_H */
@@ -0,0 +1,17 @@
+#ifndef _USBD_GS_CAN_H
+#define _USBD_GS_CAN_H
+
+#include "usbd_ioreq.h"
+
+#define GS_IN_EP		0x81
+#define GS_OUT_EP		0x02
+#define GS_MAX_PACKET_SIZE	32
+
+#define GS_IN_QUEUE_LEN		32	/* must be a power of two */
+#define GS_OUT_QUEUE_LEN	16	/* must be a power of two */
+
+extern USBD_Class_cb_TypeDef USBD_GS_CAN_cb;
+
+void task_gs(void *vpars);
+
+#endif /* _USBD_GS_CAN_H */
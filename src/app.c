@@ -1,5 +1,4 @@
 #include <unistd.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -12,6 +11,9 @@
 #include "usbd_usr.h"
 #include "usb_conf.h"
 #include "usbd_desc.h"
+#ifdef USE_GS_USB
+#include "usbd_gs_can.h"
+#endif
 #include "stm32f4xx_gpio.h"
 #include "f4d_leds.h"
 #endif
@@ -20,20 +22,57 @@
 #include "stm32f0xx_gpio.h"
 #include "stm32f0xx_rcc.h"
 #include "stm32f0xx_usart.h"
+#include "usart_dma.h"
 #endif
 
 #include "can.h"
 #include "can_msg.h"
 
 #include "delay.h"
+#include "newlib_stubs.h"
+#include "timebase.h"
+#include "hist.h"
+#include "can_load.h"
+#include "flood.h"
+#include "slcan.h"
+#include "script.h"
+#include "replay.h"
+#include "capture.h"
+#include "filter.h"
+#include "prof.h"
+#include "bench.h"
+#include "trace.h"
+#include "fmt.h"
 #include "version.h"
 
-#define TXRXDELTAMAX	256
+/* ping sequence window, must be a power of two */
+#ifdef TARGET_F407
+#define PING_WINDOW	4096
+#endif
+#ifdef TARGET_F091
+#define PING_WINDOW	512
+#endif
+#define PING_ACKED	0x80000000
+
+#define TXRXDELTAMAX	PING_WINDOW
+#define TXRXDELTADFL	256
 
-static volatile uint32_t ping_pending[TXRXDELTAMAX];
+/*
+ * Outstanding pings indexed by sequence number modulo the window. A slot
+ * holds the sequence number while pending and is tagged with PING_ACKED
+ * once answered. Sequence numbers below ping_tail are expired.
+ */
+static volatile uint32_t ping_pending[PING_WINDOW];
+/* TX completion time, us; the enqueue time until the frame is out */
+static volatile uint32_t ping_sent[PING_WINDOW];
+static struct hist ping_rtt;
+static volatile uint32_t ping_tail, ping_head;
 static volatile int ping_rx, ping_tx, ping_pending_count, ping_trace;
-static volatile int txrxdelta = TXRXDELTAMAX;
-static volatile int timeout = TXRXDELTAMAX / 10 + 1;
+static volatile int ping_dup, ping_orphan;
+static volatile int txrxdelta = TXRXDELTADFL;
+/* for the stack high-water marks in `xstat` */
+static TaskHandle_t can_task, chat_task, dump_task_h;
+static volatile int timeout = TXRXDELTADFL / 10 + 1;
 
 #define TXRXDELTA	(txrxdelta)
 #define PING_TIMEOUT	(timeout)
@@ -58,16 +97,6 @@ void task_can(void *vpars);
 int main(void)
 {
 	GPIO_InitTypeDef sGPIOinit;
-#ifdef TARGET_F091
-	USART_InitTypeDef usart_init = {
-		.USART_BaudRate = 115200,
-		.USART_WordLength = USART_WordLength_8b,
-		.USART_Parity = USART_Parity_No,
-		.USART_StopBits = USART_StopBits_1,
-		.USART_HardwareFlowControl = USART_HardwareFlowControl_None,
-		.USART_Mode = USART_Mode_Tx | USART_Mode_Rx
-	};
-#endif /* TARGET_F091 */
 
 #ifdef TARGET_F407
 	/* Required by the FreeRTOS */
@@ -95,112 +124,162 @@ int main(void)
 		USB_OTG_FS_CORE_ID,
 #endif
 		&USR_desc,
+#ifdef USE_GS_USB
+		&USBD_GS_CAN_cb,
+#else
 		&USBD_CDC_cb,
+#endif
 		&USR_cb);
 #endif /* TARGET_F407 */
 #ifdef TARGET_F091
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, ENABLE);
-	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA, ENABLE);
-
-	GPIO_PinAFConfig(GPIOA, GPIO_PinSource2, GPIO_AF_1);
-	GPIO_PinAFConfig(GPIOA, GPIO_PinSource3, GPIO_AF_1);
-
-	sGPIOinit.GPIO_Mode = GPIO_Mode_AF;
-	sGPIOinit.GPIO_Speed = GPIO_Speed_Level_2;
-	sGPIOinit.GPIO_OType = GPIO_OType_PP;
-	sGPIOinit.GPIO_PuPd = GPIO_PuPd_NOPULL;
-	sGPIOinit.GPIO_Pin = GPIO_Pin_2;
-	GPIO_Init(GPIOA, &sGPIOinit);
-
-	sGPIOinit.GPIO_Pin = GPIO_Pin_3;
-	GPIO_Init(GPIOA, &sGPIOinit);
-
-	USART_Init(USART2, &usart_init);
-
-	USART_Cmd(USART2, ENABLE);
+	usart_dma_init(USART_BAUD_DFL);
 #endif /* TARGET_F091 */
 
-	/* disable stdio buffering */
-	setvbuf(stdin, NULL, _IONBF, 0);
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
-
-	printf("\r\n\nuCAN" __VERSION "\r\n\n");
+	xprintf("\r\n\nuCAN" __VERSION "\r\n\n");
 
+	timebase_init();
 	can_init();
 
 	xTaskCreate(task_blink, "blink", 100, NULL,
 		    tskIDLE_PRIORITY + 1, NULL);
 
-	xTaskCreate(task_can, "task_can", 1000, NULL,
+#ifdef USE_GS_USB
+	/* no console: the board is a plain USB-CAN adapter */
+	xTaskCreate(task_gs, "task_gs", 400, NULL,
 		    tskIDLE_PRIORITY + 3, NULL);
+	vTaskStartScheduler();
+#endif
 
-	xTaskCreate(task_chat, "task_chat", 1000, NULL,
-		    tskIDLE_PRIORITY + 1, NULL);
+	/* sized for xprintf(), see `xstat` for the high-water marks */
+	xTaskCreate(task_can, "task_can", 256, NULL,
+		    tskIDLE_PRIORITY + 3, &can_task);
+
+	xTaskCreate(task_chat, "task_chat", 512, NULL,
+		    tskIDLE_PRIORITY + 1, &chat_task);
+
+	xTaskCreate(task_dump, "task_dump", 600, NULL,
+		    tskIDLE_PRIORITY + 1, &dump_task_h);
 	vTaskStartScheduler();
 }
 
+static inline volatile uint32_t *ping_slot(uint32_t x)
+{
+	return &ping_pending[x & (PING_WINDOW - 1)];
+}
+
+/* ping_remove_pending() outcomes */
+#define PING_REPLY_ACK		1
+#define PING_REPLY_DUP		2
+#define PING_REPLY_ORPHAN	3
+
+/*
+ * x must be ping_head, interrupts disabled. No output in here: _write
+ * may block, print traces once interrupts are enabled again.
+ */
 static inline void ping_add_pending(uint32_t x)
 {
-	int i = 0;
+	ping_sent[x & (PING_WINDOW - 1)] = timebase_now();
+	*ping_slot(x) = x;
+	ping_head = x + 1;
+}
 
-	while (i < TXRXDELTA && ping_pending[i])
-		i++;
-	if (i < TXRXDELTA) {
-		ping_pending[i] = x;
-		if (ping_trace)
-			printf("s %08x\r\n", x);
-	}
+/*
+ * CAN TX interrupt: a ping left the controller, `tag` is its sequence
+ * number. Start the RTT there, not before the wait for queue space.
+ */
+static void ping_tx_done(uint32_t x, int ok, uint32_t now, BaseType_t *woken)
+{
+	/* not expired and its slot not reused meanwhile */
+	if (ok && *ping_slot(x) == x)
+		ping_sent[x & (PING_WINDOW - 1)] = now;
 }
 
-static inline int ping_remove_pending(uint32_t x)
+/* ts is the reply RX time, interrupts disabled, returns PING_REPLY_* */
+static inline int ping_remove_pending(uint32_t x, uint32_t ts)
 {
-	int i = 0;
-	uint32_t max = 0;
+	volatile uint32_t *p = ping_slot(x);
 
-	while (i < TXRXDELTA && ping_pending[i] != x) {
-		if (ping_pending[i] && max < ping_pending[i])
-			max = ping_pending[i];
-		i++;
+	if (x >= ping_tail && x < ping_head && *p == x) {
+		*p = x | PING_ACKED;
+		hist_add(&ping_rtt, ts - ping_sent[x & (PING_WINDOW - 1)]);
+		return PING_REPLY_ACK;
 	}
-	if (i < TXRXDELTA) {
-		ping_pending[i] = 0;
-		if (ping_trace)
-			printf("a %08x\r\n", x);
-		return 1;
+	if (*p == (x | PING_ACKED)) {
+		ping_dup += 1;
+		return PING_REPLY_DUP;
 	}
-	if (ping_trace)
-		printf("orphaned: %08x max: %08x\r\n", x, max);
-	return 0;
+	ping_orphan += 1;
+	return PING_REPLY_ORPHAN;
+}
+
+static void ping_trace_reply(int ret, uint32_t x, uint32_t tail)
+{
+	switch (ret) {
+	case PING_REPLY_ACK:
+		xprintf("a %08x\r\n", x);
+		break;
+	case PING_REPLY_DUP:
+		xprintf("duplicate: %08x\r\n", x);
+		break;
+	case PING_REPLY_ORPHAN:
+		xprintf("orphaned: %08x tail: %08x\r\n", x, tail);
+		break;
+	}
+}
+
+/* drop everything in flight, interrupts disabled */
+static inline void ping_expire_pending()
+{
+	ping_tail = ping_head;
+	ping_pending_count = 0;
+}
+
+/*
+ * Move ping_tail past answered pings so that the slot of the next
+ * sequence number is known to be free. Only the sender moves the tail,
+ * each sequence number is stepped over once.
+ */
+static inline void ping_sweep()
+{
+	while (ping_tail != ping_head && *ping_slot(ping_tail) != ping_tail)
+		ping_tail++;
 }
 
 static void can_ping(int id, int count)
 {
-	TickType_t tim, timp;
+	TickType_t timp;
+	uint32_t tim;
 	struct can_msg msg;
 	int pending, max = 0, i, ping_tout = 0;
 
 	msg.type = CAN_MSG_PING;
 	msg.sender = can_id;
 
-	tim = xTaskGetTickCount();
+	tim = timebase_now();
 
 	ping_tx = 0;
 	ping_rx = 0;
+	ping_dup = 0;
+	ping_orphan = 0;
 	ping_pending_count = 0;
-	memset(ping_pending, 0, sizeof(ping_pending));
+	hist_reset(&ping_rtt);
+	memset((void *)ping_pending, 0, sizeof(ping_pending));
+	ping_tail = 1;
+	ping_head = 1;
+	can_tx_notify(ping_tx_done);
 	for (i = 0; i < count; i++) {
 		timp = xTaskGetTickCount();
 		while (1) {
+			ping_sweep();
 			taskDISABLE_INTERRUPTS();
 			pending = ping_pending_count;
 			taskENABLE_INTERRUPTS();
-			if (pending < TXRXDELTA)
+			if (pending < TXRXDELTA &&
+			    ping_head - ping_tail < PING_WINDOW)
 				break;
 			if (xTaskGetTickCount() - timp > PING_TIMEOUT) {
 				taskDISABLE_INTERRUPTS();
-				memset(ping_pending, 0, sizeof(ping_pending));
-				ping_pending_count = 0;
+				ping_expire_pending();
 				ping_tout += 1;
 				taskENABLE_INTERRUPTS();
 				break;
@@ -214,7 +293,18 @@ static void can_ping(int id, int count)
 		if (ping_pending_count > max)
 			max = ping_pending_count;
 		taskENABLE_INTERRUPTS();
-		can_xmit(id, &msg, sizeof(msg));
+		if (ping_trace)
+			xprintf("s %08x\r\n", msg.data);
+		if (can_xmit_wait(id, &msg, sizeof(msg), PING_TIMEOUT,
+				  msg.data)) {
+			taskDISABLE_INTERRUPTS();
+			/* never sent, release the slot without a sample */
+			*ping_slot(msg.data) = msg.data | PING_ACKED;
+			ping_pending_count -= 1;
+			ping_tout += 1;
+			taskENABLE_INTERRUPTS();
+			continue;
+		}
 		ping_tx += 1;
 	}
 
@@ -228,177 +318,663 @@ static void can_ping(int id, int count)
 		pending = ping_pending_count;
 		taskENABLE_INTERRUPTS();
 	}
+	can_tx_notify(NULL);
 
-	tim = xTaskGetTickCount() - tim;
-	printf("Max pending: %d\r\n", max);
-	printf("# timeouts: %d\r\n", ping_tout);
-	printf("TX: %d\r\n", ping_tx);
-	printf("RX: %d\r\n", ping_rx);
-	printf("Time: %d ms\r\n", tim);
+	tim = timebase_now() - tim;
+	xprintf("Max pending: %d\r\n", max);
+	xprintf("# timeouts: %d\r\n", ping_tout);
+	xprintf("TX: %d\r\n", ping_tx);
+	xprintf("RX: %d\r\n", ping_rx);
+	xprintf("Duplicates: %d\r\n", ping_dup);
+	xprintf("Orphans: %d\r\n", ping_orphan);
+	xprintf("Time: %u.%03u ms\r\n", tim / 1000, tim % 1000);
+	xprintf("RTT (us): min %u mean %u max %u\r\n",
+	       ping_rtt.count ? ping_rtt.min : 0,
+	       hist_mean(&ping_rtt),
+	       ping_rtt.max);
+	xprintf("RTT (us): p50 %u p90 %u p99 %u p99.9 %u\r\n",
+	       hist_quantile(&ping_rtt, 50, 100),
+	       hist_quantile(&ping_rtt, 90, 100),
+	       hist_quantile(&ping_rtt, 99, 100),
+	       hist_quantile(&ping_rtt, 999, 1000));
+	xprintf("Jitter: %u us\r\n", hist_jitter(&ping_rtt));
 }
 
-void task_chat(void *vpars)
+/* raw RTT buckets of the last ping: "<lowest us> <count>" per line */
+static void can_ping_hist()
 {
-#define CMD_LEN 255
-	int c;
-	char cmd[CMD_LEN+1];
-	int pos = 0;
-	char *tk;
+	int i;
 
-	printf(PS1);
+	xprintf("# %u samples\r\n", ping_rtt.count);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (ping_rtt.bucket[i])
+			xprintf("%u %u\r\n", hist_bucket_low(i),
+			       ping_rtt.bucket[i]);
+}
 
+/* set while the console speaks SLCAN: the node stays passive on the bus */
+static volatile int slcan_on;
+static struct slcan slcan;
+
+static int slcan_open(int listen, int timestamp)
+{
+	can_set_listen(listen);
+	can_filter_setup(can_id, 0);
+	can_dump_pkt(CAN_DUMP_SLCAN | (timestamp ? CAN_DUMP_TS : 0));
+	return 0;
+}
+
+static int slcan_close(void)
+{
+	can_dump_pkt(0);
+	can_xmit_cancel();
+	if (slcan.open == 'L')
+		can_set_listen(0);
+	return 0;
+}
+
+static int slcan_xmit(const struct slcan_frame *f)
+{
+	uint32_t ir;
+
+	ir = f->ext ? (f->id << 3) | CAN_ID_EXT : f->id << 21;
+	if (f->rtr)
+		ir |= CAN_RTR_REMOTE;
+	return can_xmit_frame(ir, (unsigned char *)f->data, f->dlc);
+}
+
+static const struct slcan_ops slcan_ops = {
+	.open = slcan_open,
+	.close = slcan_close,
+	.bitrate = can_set_bitrate,
+	.xmit = slcan_xmit,
+};
+
+/* Serve SLCAN on the console until ESC, frames are emitted by task_dump */
+static void slcan_mode()
+{
+	char reply[8];
+	int c, n;
+
+	slcan_init(&slcan, &slcan_ops);
+	slcan.bitrate = can_bitrate;
+	can_dump_pkt(0);
+	slcan_on = 1;
 	while (1) {
-		fflush(stdout);
-		c = getchar();
-		putchar(c);
-		if (c == '\b') {
-			if (pos > 0)
-				pos--;
-			continue;
-		}
-		if (c == '\r') {
-			int i;
+		c = xgetc();
+		if (c == 0x1b)
+			break;
+		n = slcan_input(&slcan, c, reply);
+		if (n)
+			xwrite(reply, n);
+	}
+	if (slcan.open)
+		slcan_close();
+	slcan_on = 0;
+}
 
-			printf("\r\n");
-			/* parse cmd */
-			cmd[pos] = 0;
-			tk = strtok(cmd, " ");
-			if (!tk || strlen(tk) == 0)
-				goto cmd_finish;
-			if (strcmp(tk, "stop") == 0) {
-				for (i = 0; i < CAN_NUM_MB; i++)
-					CAN_CancelTransmit(CANx, i);
-			} else if (strcmp(tk, "udelay") == 0) {
-				TickType_t tim;
-				int cnt, del;
+#define SCRIPT_US_PER_TICK	(1000000 / configTICK_RATE_HZ)
+static struct script script;
+static TaskHandle_t script_task;
 
+static uint32_t script_now(void)
+{
+	return timebase_now();
+}
+
+/* TIM2 compare at the script's deadline */
+static void script_alarm(void)
+{
+	BaseType_t woken = pdFALSE;
+
+	vTaskNotifyGiveFromISR(script_task, &woken);
+	portEND_SWITCHING_ISR(woken);
+}
+
+/*
+ * Block until `t` on a timebase alarm, to the microsecond and without
+ * holding up other tasks. The tick bounds each wait in case other
+ * notifications wake the task early. Replays share the alarm, they
+ * never run alongside a script's wait.
+ */
+static void script_wait(uint32_t t)
+{
+	int32_t d;
+
+	script_task = xTaskGetCurrentTaskHandle();
+	timebase_alarm(t, script_alarm);
+	while ((d = t - timebase_now()) > 0)
+		ulTaskNotifyTake(pdTRUE, d / SCRIPT_US_PER_TICK + 1);
+	timebase_alarm_cancel();
+}
+
+/*
+ * ESC typed while a script, `top` or a replay runs aborts it, together
+ * with whatever was typed before it. Other input is left queued, unless
+ * it fills half the ring: the USB OUT endpoint stalls short of full and
+ * no ESC could get in behind it, so that aborts and drains too.
+ */
+static int script_abort(void)
+{
+	unsigned int i, n = ring_len(&stdin_ring);
+
+	for (i = 0; i < n; i++)
+		if (stdin_ring.buf[(stdin_ring.out + i) &
+				   (STDIN_BUFFER_SIZE - 1)] == 0x1b)
+			break;
+	if (i < n)
+		stdin_drop(i + 1);
+	else if (n >= STDIN_BUFFER_SIZE / 2)
+		stdin_drop(n);
+	else
+		return 0;
+	return 1;
+}
+
+/* "0102ff.." into up to 8 bytes, the rest is zeroed; returns the count */
+static int parse_bytes(const char *s, uint8_t *b)
+{
+	char hex[3] = {0};
+	char *end;
+	int i;
+
+	memset(b, 0, 8);
+	for (i = 0; i < 8 && s[0] && s[1]; i++, s += 2) {
+		hex[0] = s[0];
+		hex[1] = s[1];
+		b[i] = strtoul(hex, &end, 0x10);
+		if (*end)
+			return -1;
+	}
+	return *s ? -1 : i;
+}
+
+static const char *filter_actions[] = {
+	"drop", "queue", "capture", "queue+capture",
+};
+
+/* filter rule action name, -1 if unknown */
+static int parse_action(const char *s)
+{
+	int i;
+
+	if (strcmp(s, "count") == 0)
+		return FILTER_COUNT;
+	for (i = 0; i < 4; i++)
+		if (strcmp(s, filter_actions[i]) == 0)
+			return i;
+	return -1;
+}
+
+static void filter_dump(const struct filter *fl)
+{
+	int i;
+
+	for (i = 0; i < fl->nrules; i++)
+		xprintf("%d: %-13s %s (%u hits)\r\n", i,
+			filter_actions[fl->rule[i].action], fl->rule[i].src,
+			fl->rule[i].hits);
+	xprintf("default: %s (%u hits)\r\n", filter_actions[fl->dfl],
+		fl->dfl_hits);
+}
+
+/* Execute one simple command, called back by the script engine */
+static int cmd_exec(char *cmd)
+{
+	char *tk;
+	int i;
+
+	tk = strtok(cmd, " ");
+	if (!tk || strlen(tk) == 0)
+		goto cmd_finish;
+	if (strcmp(tk, "stop") == 0) {
+		can_xmit_cancel();
+	} else if (strcmp(tk, "udelay") == 0) {
+		TickType_t tim;
+		int cnt, del;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		del = strtol(tk, NULL, 10);
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		cnt = strtol(tk, NULL, 10);
+		tim = xTaskGetTickCount();
+		while (cnt--)
+			udelay(del);
+		tim = xTaskGetTickCount() - tim;
+		xprintf("time elapsed: %d ms\r\n", tim);
+	} else if (strcmp(tk, "sleep") == 0) {
+		int t;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		t = strtol(tk, NULL, 10);
+		vTaskDelay(t);
+	} else if (strcmp(tk, "dump") == 0) {
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		if (strcmp(tk, "on") == 0)
+			can_dump_pkt(1);
+		else if (strcmp(tk, "off") == 0)
+			can_dump_pkt(0);
+		else
+			goto cmd_error;
+	} else if (strcmp(tk, "baud") == 0) {
+#ifdef TARGET_F091
+		unsigned int baud;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		baud = strtoul(tk, NULL, 10);
+		xprintf("switching to %u baud\r\n", baud);
+		if (usart_set_baud(baud))
+			goto cmd_error;
+#else
+		/* USB VCP: the line rate is meaningless */
+		goto cmd_error;
+#endif
+	} else if (strcmp(tk, "slcan") == 0) {
+		slcan_mode();
+	} else if (strcmp(tk, "flood") == 0) {
+		enum flood_mode mode;
+		unsigned int rate = 0, ms;
+		char *end;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			flood_dump_config();
+		} else if (strcmp(tk, "ids") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL || flood_set_ids(tk))
+				goto cmd_error;
+		} else if (strcmp(tk, "dlc") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL || flood_set_dlcs(tk))
+				goto cmd_error;
+		} else if (strcmp(tk, "data") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			if (strcmp(tk, "counter") == 0) {
+				flood_set_pattern(FLOOD_COUNTER, 0);
+			} else if (strcmp(tk, "random") == 0) {
+				flood_set_pattern(FLOOD_RANDOM, 0);
+			} else if (strcmp(tk, "const") == 0) {
 				tk = strtok(NULL, " ");
 				if (tk == NULL)
 					goto cmd_error;
-				del = strtol(tk, NULL, 10);
-				tk = strtok(NULL, " ");
-				if (tk == NULL)
+				flood_set_pattern(FLOOD_CONST,
+					strtoul(tk, NULL, 0x10));
+			} else {
+				goto cmd_error;
+			}
+		} else if (strcmp(tk, "run") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			if (strcmp(tk, "max") == 0) {
+				mode = FLOOD_MAX;
+			} else {
+				/* "<fps>" or "<load>%", load may have one decimal */
+				rate = strtoul(tk, &end, 10);
+				if (*end == '%' || *end == '.') {
+					mode = FLOOD_LOAD;
+					rate *= 10;
+					if (*end == '.')
+						rate += strtoul(end + 1, &end, 10) % 10;
+					if (*end != '%' || rate > 1000)
+						goto cmd_error;
+				} else {
+					mode = FLOOD_FPS;
+				}
+				if (!rate)
 					goto cmd_error;
-				cnt = strtol(tk, NULL, 10);
-				tim = xTaskGetTickCount();
-				while (cnt--)
-					udelay(del);
-				tim = xTaskGetTickCount() - tim;
-				printf("time elapsed: %d ms\r\n", tim);
-			} else if (strcmp(tk, "sleep") == 0) {
-				int t;
+			}
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			ms = strtoul(tk, NULL, 10);
+			flood_run(mode, rate, ms);
+		} else {
+			goto cmd_error;
+		}
+	} else if (strcmp(tk, "load") == 0) {
+		can_load_dump();
+	} else if (strcmp(tk, "capture") == 0) {
+		uint8_t pat[8], mask[8];
+		unsigned int post = CAPTURE_FRAMES / 2;
+		uint32_t id;
+		int n;
 
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			capture_status();
+		} else if (strcmp(tk, "arm") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk != NULL)
+				post = strtoul(tk, NULL, 10);
+			if (capture_arm(post))
+				goto cmd_error;
+		} else if (strcmp(tk, "stop") == 0) {
+			capture_stop();
+		} else if (strcmp(tk, "dump") == 0) {
+			capture_dump();
+		} else if (strcmp(tk, "trig") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			if (strcmp(tk, "id") == 0) {
 				tk = strtok(NULL, " ");
 				if (tk == NULL)
 					goto cmd_error;
-				t = strtol(tk, NULL, 10);
-				vTaskDelay(t);
-			} else if (strcmp(tk, "dump") == 0) {
-				tk = strtok(NULL, " ");
-				if (tk == NULL)
-					goto cmd_error;
-				if (strcmp(tk, "on") == 0)
-					can_dump_pkt(1);
-				else if (strcmp(tk, "off") == 0)
-					can_dump_pkt(0);
-				else
-					goto cmd_error;
-			} else if (strcmp(tk, "xstat") == 0) {
-				can_dump_tx();
-			} else if (strcmp(tk, "stat") == 0) {
+				id = strtoul(tk, NULL, 0x10);
 				tk = strtok(NULL, " ");
-				if (tk != NULL && strcmp(tk, "reset") == 0)
-					can_stat_reset();
-				can_stat_dump();
-			} else if (strcmp(tk, "ping") == 0) {
-				int id, count;
-
+				capture_trig_id(id, tk == NULL ? 0x1fffffff :
+						strtoul(tk, NULL, 0x10));
+			} else if (strcmp(tk, "data") == 0) {
 				tk = strtok(NULL, " ");
-				if (tk == NULL)
+				if (tk == NULL || (n = parse_bytes(tk, pat)) < 0)
 					goto cmd_error;
-				id = strtol(tk, NULL, 0x10);
-
+				/* by default the given bytes must match exactly */
 				tk = strtok(NULL, " ");
+				memset(mask, 0, sizeof(mask));
 				if (tk == NULL)
+					memset(mask, 0xff, n);
+				else if (parse_bytes(tk, mask) < 0)
 					goto cmd_error;
-				count = strtol(tk, NULL, 10);
+				capture_trig_data(pat, mask);
+			} else if (strcmp(tk, "err") == 0) {
+				capture_trig_err(1);
+			} else if (strcmp(tk, "off") == 0) {
+				capture_trig_off();
+			} else {
+				goto cmd_error;
+			}
+		} else {
+			goto cmd_error;
+		}
+	} else if (strcmp(tk, "filter") == 0) {
+		/* too big for the task stack; only task_chat gets here */
+		static struct filter fl;
+		static struct filter_rule r;
+		int act;
 
-				tk = strtok(NULL, " ");
-				if (tk == NULL)
-					ping_trace = 0;
-				else
-					ping_trace = 1;
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			can_rx_filter_get(&fl);
+			filter_dump(&fl);
+			goto cmd_finish;
+		} else if (strcmp(tk, "add") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL || (act = parse_action(tk)) < 0)
+				goto cmd_error;
+			tk = strtok(NULL, "");
+			if (tk == NULL || filter_rule_init(&r, act, tk) ||
+			    can_rx_filter_add(&r))
+				goto cmd_error;
+		} else if (strcmp(tk, "del") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL ||
+			    can_rx_filter_del(strtoul(tk, NULL, 10)))
+				goto cmd_error;
+		} else if (strcmp(tk, "clear") == 0) {
+			can_rx_filter_clear();
+		} else if (strcmp(tk, "default") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL || (act = parse_action(tk)) < 0)
+				goto cmd_error;
+			can_rx_filter_default(act);
+		} else {
+			goto cmd_error;
+		}
+	} else if (strcmp(tk, "replay") == 0) {
+		unsigned int n, speed = 100;
+		uint32_t crc;
 
-				can_ping(id, count);
-			} else if (strcmp(tk, "send") == 0) {
-				unsigned int id, len;
-				unsigned char data[8];
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			replay_dump();
+		} else if (strcmp(tk, "load") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			n = strtoul(tk, NULL, 10);
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			crc = strtoul(tk, NULL, 0x10);
+			if (replay_load(n, crc))
+				return 1;
+			replay_dump();
+		} else if (strcmp(tk, "run") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk != NULL)
+				speed = strtoul(tk, NULL, 10);
+			if (replay_start(speed))
+				goto cmd_error;
+			/* ESC stops the replay early */
+			while (replay_running() && !script_abort())
+				vTaskDelay(10);
+			replay_stop();
+			replay_stat_dump();
+		} else if (strcmp(tk, "stat") == 0) {
+			replay_stat_dump();
+		} else {
+			goto cmd_error;
+		}
+	} else if (strcmp(tk, "top") == 0) {
+		unsigned int period = 1000, count = 0, t;
 
-				/* Transmit Structure preparation */
-				tk = strtok(NULL, " ");
-				if (tk == NULL)
-					goto cmd_error;
-				id = strtol(tk, NULL, 0x10);
-				printf("addr: %03x\r\n", id);
-				i = 0;
-				do {
-					tk = strtok(NULL, " ");
-					if (tk == NULL)
-						break;
-					data[i] = strtol(tk, NULL, 0x10);
-					i++;
-				} while (i < 8);
-				if (i == 0)
-					goto cmd_error;
-				printf("payload:");
-				len = i;
-				for (i = 0; i < len; i++)
-					printf(" %02x", data[i]);
-				printf("\r\n");
+		tk = strtok(NULL, " ");
+		if (tk != NULL)
+			period = strtoul(tk, NULL, 10);
+		tk = strtok(NULL, " ");
+		if (tk != NULL)
+			count = strtoul(tk, NULL, 10);
+		/* run-time counters are 32 bits, only one wrap can be told */
+		if (period < 100 || period > PROF_TOP_MAX_MS)
+			goto cmd_error;
+		prof_top_reset();
+		/* COUNT 0: until ESC */
+		for (i = 0; !count || i < count; i++) {
+			for (t = 0; t < period; t += 100) {
+				vTaskDelay(100);
+				if (script_abort())
+					goto cmd_finish;
+			}
+			prof_top();
+			xprintf("\r\n");
+		}
+	} else if (strcmp(tk, "bench") == 0) {
+		if (bench_run(strtok(NULL, " ")))
+			goto cmd_error;
+	} else if (strcmp(tk, "trace") == 0) {
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			trace_status();
+		} else if (strcmp(tk, "start") == 0) {
+			tk = strtok(NULL, " ");
+			trace_start(tk == NULL ? TRACE_ALL : strtoul(tk, NULL, 0x10));
+		} else if (strcmp(tk, "stop") == 0) {
+			trace_stop();
+		} else if (strcmp(tk, "dump") == 0) {
+			if (trace_dump())
+				goto cmd_error;
+		} else if (strcmp(tk, "mark") == 0) {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				goto cmd_error;
+			i = strtoul(tk, NULL, 10);
+			tk = strtok(NULL, " ");
+			TRACE(TRACE_MARK, TRACE_MARK_USER + i,
+			      tk == NULL ? 0 : strtoul(tk, NULL, 0x10));
+		} else {
+			goto cmd_error;
+		}
+	} else if (strcmp(tk, "isrstat") == 0) {
+		tk = strtok(NULL, " ");
+		if (tk != NULL && strcmp(tk, "reset") == 0)
+			prof_isr_reset();
+		else
+			prof_isr_dump();
+	} else if (strcmp(tk, "xstat") == 0) {
+		can_dump_tx();
+		xprintf("stack free (words): can %u chat %u dump %u\r\n",
+			(unsigned int)uxTaskGetStackHighWaterMark(can_task),
+			(unsigned int)uxTaskGetStackHighWaterMark(chat_task),
+			(unsigned int)uxTaskGetStackHighWaterMark(dump_task_h));
+#ifdef TARGET_F091
+		xprintf("console rx dropped: %u\r\n",
+		       (unsigned int)usart_rx_dropped);
+#endif
+	} else if (strcmp(tk, "stat") == 0) {
+		tk = strtok(NULL, " ");
+		if (tk != NULL && strcmp(tk, "reset") == 0)
+			can_stat_reset();
+		can_stat_dump();
+	} else if (strcmp(tk, "ping") == 0) {
+		int id, count;
 
-				can_xmit(id, data, len);
-			} else if (strcmp(tk, "addr") == 0) {
-				unsigned int id;
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		if (strcmp(tk, "hist") == 0) {
+			can_ping_hist();
+			goto cmd_finish;
+		}
+		id = strtol(tk, NULL, 0x10);
 
-				tk = strtok(NULL, " ");
-				if (tk == NULL) {
-					printf("0x%08x\r\n", can_id);
-					goto cmd_finish;
-				};
-				id = strtoul(tk, NULL, 0x10);
-				can_filter_setup(id, 0x7ff);
-			} else if (strcmp(tk, "txrxdelta") == 0) {
-				unsigned int id;
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		count = strtol(tk, NULL, 10);
 
-				tk = strtok(NULL, " ");
-				if (tk == NULL) {
-					printf("%d\r\n", txrxdelta);
-					goto cmd_finish;
-				};
-				txrxdelta = strtoul(tk, NULL, 10);
-				if (txrxdelta < 1)
-					txrxdelta = 1;
-				if (txrxdelta > TXRXDELTAMAX)
-					txrxdelta = TXRXDELTAMAX;
-			} else if (strcmp(tk, "timeout") == 0) {
-				unsigned int id;
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			ping_trace = 0;
+		else
+			ping_trace = 1;
 
-				tk = strtok(NULL, " ");
-				if (tk == NULL) {
-					printf("%d\r\n", timeout);
-					goto cmd_finish;
-				};
-				timeout = strtoul(tk, NULL, 10);
-				if (timeout < 1)
-					timeout = 1;
-			} else {
-				printf("unknown command `%s`\r\n", tk);
-			}
+		can_ping(id, count);
+	} else if (strcmp(tk, "send") == 0) {
+		unsigned int id, len;
+		unsigned char data[8];
+
+		/* Transmit Structure preparation */
+		tk = strtok(NULL, " ");
+		if (tk == NULL)
+			goto cmd_error;
+		id = strtol(tk, NULL, 0x10);
+		xprintf("addr: %03x\r\n", id);
+		i = 0;
+		do {
+			tk = strtok(NULL, " ");
+			if (tk == NULL)
+				break;
+			data[i] = strtol(tk, NULL, 0x10);
+			i++;
+		} while (i < 8);
+		if (i == 0)
+			goto cmd_error;
+		xprintf("payload:");
+		len = i;
+		for (i = 0; i < len; i++)
+			xprintf(" %02x", data[i]);
+		xprintf("\r\n");
+
+		if (can_xmit(id, data, len))
+			xprintf("TX queue full\r\n");
+	} else if (strcmp(tk, "addr") == 0) {
+		unsigned int id;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			xprintf("0x%08x\r\n", can_id);
 			goto cmd_finish;
-cmd_error:
-			printf("can't parse command\r\n");
+		};
+		id = strtoul(tk, NULL, 0x10);
+		can_filter_setup(id, 0x7ff);
+	} else if (strcmp(tk, "txrxdelta") == 0) {
+		unsigned int id;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			xprintf("%d\r\n", txrxdelta);
+			goto cmd_finish;
+		};
+		txrxdelta = strtoul(tk, NULL, 10);
+		if (txrxdelta < 1)
+			txrxdelta = 1;
+		if (txrxdelta > TXRXDELTAMAX)
+			txrxdelta = TXRXDELTAMAX;
+	} else if (strcmp(tk, "timeout") == 0) {
+		unsigned int id;
+
+		tk = strtok(NULL, " ");
+		if (tk == NULL) {
+			xprintf("%d\r\n", timeout);
+			goto cmd_finish;
+		};
+		timeout = strtoul(tk, NULL, 10);
+		if (timeout < 1)
+			timeout = 1;
+	} else if (strcmp(tk, "macros") == 0) {
+		const struct script_macro *m;
+
+		for (i = 0; (m = script_macro(&script, i)) != NULL; i++)
+			xprintf("%s { %s }\r\n", m->name, m->body);
+	} else {
+		xprintf("unknown command `%s`\r\n", tk);
+		return 1;
+	}
 cmd_finish:
-			printf(PS1);
+	return 0;
+cmd_error:
+	return SCRIPT_ESYNTAX;
+}
+
+static const struct script_ops script_ops = {
+	.exec = cmd_exec,
+	.now = script_now,
+	.wait_until = script_wait,
+	.abort = script_abort,
+};
+
+void task_chat(void *vpars)
+{
+#define CMD_LEN 255
+	int c, ret;
+	char cmd[CMD_LEN+1];
+	int pos = 0;
+
+	script_init(&script, &script_ops);
+	xprintf(PS1);
+
+	while (1) {
+		c = xgetc();
+		xputc(c);
+		if (c == '\b') {
+			if (pos > 0)
+				pos--;
+			continue;
+		}
+		if (c == '\r') {
+			xprintf("\r\n");
+			cmd[pos] = 0;
+			ret = script_run(&script, cmd);
+			if (ret == SCRIPT_ESYNTAX)
+				xprintf("can't parse command\r\n");
+			else if (ret == SCRIPT_EABORT)
+				xprintf("aborted\r\n");
+			else if (ret == SCRIPT_ENOMEM)
+				xprintf("no room for macro\r\n");
+			xprintf(PS1);
 			pos = 0;
 			continue;
 		}
@@ -437,10 +1013,13 @@ void task_can(void *vpars)
 {
 	struct can_msg msg;
 	unsigned int to;
+	uint32_t ts, tail;
 	int len, ret;
 
 	while (1) {
-		len = can_recv(&msg);
+		len = can_recv(&msg, &ts);
+		if (slcan_on)
+			continue;
 		if (len == sizeof(msg) &&
 		    msg.type == CAN_MSG_PING) {
 			if (msg.sender != 0) {
@@ -448,13 +1027,19 @@ void task_can(void *vpars)
 				msg.sender = 0;
 				can_xmit(to, &msg, len);
 			} else {
+				ret = 0;
 				taskDISABLE_INTERRUPTS();
 				if (ping_pending_count) {
-					ret = ping_remove_pending(msg.data);
-					ping_rx += ret;
-					ping_pending_count -= ret;
+					ret = ping_remove_pending(msg.data, ts);
+					if (ret == PING_REPLY_ACK) {
+						ping_rx += 1;
+						ping_pending_count -= 1;
+					}
 				}
+				tail = ping_tail;
 				taskENABLE_INTERRUPTS();
+				if (ping_trace)
+					ping_trace_reply(ret, msg.data, tail);
 			}
 		}
 	}
@@ -0,0 +1,224 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#ifdef TARGET_F407
+#include "usbd_cdc_vcp.h"
+#endif
+#include "can.h"
+#include "capture.h"
+#include "ring.h"
+#include "delay.h"
+#include "prof.h"
+#include "fmt.h"
+#include "bench.h"
+
+/* prof_now() ticks to CPU cycles: 1 on the F407, 48 on the F091 */
+#define BENCH_CYCLES	(configCPU_CLOCK_HZ / PROF_HZ)
+
+int _write(int file, char *ptr, int len);
+
+RING_DECLARE(bench_ring, struct can_frame, 64);
+static struct bench_ring bench_ring;
+static struct can_frame bench_sink;
+
+static const struct can_frame bench_frame = {
+	.ir = 0x123 << 21,
+	.dtr = 8,
+	.data = {0xde, 0xad, 0xbe, 0xef, 0x01, 0x23, 0x45, 0x67},
+	.ts = 12345678,
+};
+
+static int bench_push(int n, uint32_t *t)
+{
+	struct bench_ring *r = &bench_ring;
+	uint32_t t0;
+
+	ring_init(r);
+	t0 = prof_now();
+	while (n--) {
+		*ring_head(r) = bench_frame;
+		ring_push(r);
+	}
+	*t = prof_now() - t0;
+	return 0;
+}
+
+static int bench_pop(int n, uint32_t *t)
+{
+	struct bench_ring *r = &bench_ring;
+	uint32_t t0;
+
+	r->out = 0;
+	r->in = n;
+	t0 = prof_now();
+	while (n--) {
+		bench_sink = *ring_tail(r);
+		ring_pop(r);
+	}
+	*t = prof_now() - t0;
+	return 0;
+}
+
+static int bench_xmit(int n, uint32_t *t)
+{
+	return can_bench_xmit(n, t);
+}
+
+static int bench_rx(int n, uint32_t *t)
+{
+	/* the synthetic frames would end up in the capture */
+	if (capture_get_state() == CAPTURE_ARMED ||
+	    capture_get_state() == CAPTURE_TRIGGERED)
+		return -1;
+	return can_bench_rx(&bench_frame, n, t);
+}
+
+static int bench_dump(int n, uint32_t *t)
+{
+	return can_bench_dump(&bench_frame, n, t);
+}
+
+/* one `capture dump` line */
+static int bench_fmt(int n, uint32_t *t)
+{
+	static char line[64];
+	const struct can_frame *f = &bench_frame;
+	uint32_t t0;
+
+	t0 = prof_now();
+	while (n--)
+		xsnprintf(line, sizeof(line),
+			  "(%u.%06u) can0 %03X#%02X%02X%02X%02X%02X%02X%02X%02X\r\n",
+			  f->ts / 1000000, f->ts % 1000000, CAN_FRAME_STDID(f),
+			  f->data[0], f->data[1], f->data[2], f->data[3],
+			  f->data[4], f->data[5], f->data[6], f->data[7]);
+	*t = prof_now() - t0;
+	return 0;
+}
+
+/* blanks and a carriage return: leaves the terminal as it was */
+static char bench_blank[64];
+
+static int bench_write(int n, uint32_t *t)
+{
+	uint32_t t0;
+
+	memset(bench_blank, ' ', n - 1);
+	bench_blank[n - 1] = '\r';
+	t0 = prof_now();
+	_write(1, bench_blank, n);
+	*t = prof_now() - t0;
+	return 0;
+}
+
+#ifdef TARGET_F407
+static int bench_vcp(int n, uint32_t *t)
+{
+	uint32_t t0;
+	int i;
+
+	memset(bench_blank, ' ', n - 1);
+	bench_blank[n - 1] = '\r';
+	/* VCP_Write() has a single writer, see vcp_write() */
+	vTaskSuspendAll();
+	if (VCP_WriteSpace() < n) {
+		xTaskResumeAll();
+		return -1;
+	}
+	t0 = prof_now();
+	for (i = 0; i < n; i++)
+		VCP_DataTx((uint8_t *)&bench_blank[i]);
+	*t = prof_now() - t0;
+	xTaskResumeAll();
+	VCP_Flush();
+	return 0;
+}
+#endif
+
+static int bench_udelay(int us, uint32_t *t)
+{
+	uint32_t t0;
+
+	t0 = prof_now();
+	udelay(us);
+	*t = prof_now() - t0;
+	return 0;
+}
+
+static const struct bench {
+	const char *name;
+	int (*fn)(int n, uint32_t *t);
+	int n, ops;
+	uint32_t expect;	/* cycles per op */
+} benches[] = {
+	{"ring_push", bench_push, 64, 64},
+	{"ring_pop", bench_pop, 64, 64},
+	{"can_xmit", bench_xmit, 8, 8},
+	{"rx_isr", bench_rx, 8, 8},
+	{"dump_text", bench_dump, 16, 16},
+	{"fmt_line", bench_fmt, 16, 16},
+	{"write", bench_write, 64, 64},
+#ifdef TARGET_F407
+	{"vcp_datatx", bench_vcp, 64, 64},
+#endif
+	{"udelay_1", bench_udelay, 1, 1, configCPU_CLOCK_HZ / 1000000},
+	{"udelay_10", bench_udelay, 10, 1, 10 * (configCPU_CLOCK_HZ / 1000000)},
+	{"udelay_100", bench_udelay, 100, 1, 100 * (configCPU_CLOCK_HZ / 1000000)},
+};
+
+/* cost of the time stamps themselves */
+static uint32_t bench_cal()
+{
+	uint32_t t0, t, min = ~0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		t0 = prof_now();
+		t = prof_now() - t0;
+		if (t < min)
+			min = t;
+	}
+	return min;
+}
+
+static void bench_one(const struct bench *b, uint32_t cal)
+{
+	uint32_t v[BENCH_TRIALS], t, x;
+	int i, j;
+
+	for (i = 0; i < BENCH_TRIALS; i++) {
+		if (b->fn(b->n, &t)) {
+			xprintf("%-11s skipped\r\n", b->name);
+			return;
+		}
+		/* tenths of a cycle per op */
+		x = (t > cal ? t - cal : 0) * BENCH_CYCLES * 10 / b->ops;
+		for (j = i; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+	xprintf("%-11s %4d %6u.%u %6u.%u %6u.%u", b->name, b->ops,
+		v[0] / 10, v[0] % 10,
+		v[BENCH_TRIALS / 2] / 10, v[BENCH_TRIALS / 2] % 10,
+		v[BENCH_TRIALS - 1] / 10, v[BENCH_TRIALS - 1] % 10);
+	if (b->expect)
+		xprintf(" %7u", b->expect);
+	xprintf("\r\n");
+}
+
+/* Run the benchmark `name`, all of them if NULL */
+int bench_run(const char *name)
+{
+	uint32_t cal = bench_cal();
+	unsigned int i;
+	int found = 0;
+
+	xprintf("cycles/op    OPS      MIN      MED      MAX  EXPECT\r\n");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (name && strcmp(name, benches[i].name))
+			continue;
+		bench_one(&benches[i], cal);
+		found = 1;
+	}
+	return found ? 0 : -1;
+}
@@ -1,4 +1,3 @@
-#include <stdio.h>
 #include <string.h>
 #include "FreeRTOS.h"
 #include "task.h"
@@ -14,15 +13,63 @@
 #endif
 #include "can.h"
 #include "can_msg.h"
-#include "uqueue.h"
+#include "ring.h"
+#include "timebase.h"
+#include "can_load.h"
+#include "slcan.h"
+#include "capture.h"
+#include "filter.h"
+#include "prof.h"
+#include "fmt.h"
 
-CanRxMsg  rx_msg[RX_QUEUE_LEN];
-CanRxMsg  rx_msg_isr[RX_QUEUE_LEN];
-struct queue rx_queue;
-struct queue rx_queue_isr;
+/* RX ISR -> task_can */
+RING_DECLARE(rx_ring, struct can_frame, RX_QUEUE_LEN);
+static struct rx_ring rx_ring;
+static volatile TaskHandle_t rx_task;
+
+/* RX ISR -> task_dump, formatted outside of the interrupt */
+RING_DECLARE(dump_ring, struct can_frame, DUMP_QUEUE_LEN);
+static struct dump_ring dump_ring;
+
+/* software RX filter, run on every frame the hardware lets through */
+static struct filter rx_filter = {
+	.dfl = FILTER_QUEUE | FILTER_CAPTURE,
+};
+
+/* software TX queue drained into the mailboxes by the TME interrupt */
+static CanTxMsg tx_msg[TX_QUEUE_LEN];
+static volatile unsigned int tx_in, tx_out;
+static volatile TaskHandle_t tx_waiter;
+static volatile uint8_t tx_status[CAN_NUM_MB] = {
+	CAN_TxStatus_NoMailBox,
+	CAN_TxStatus_NoMailBox,
+	CAN_TxStatus_NoMailBox,
+};
+static volatile uint32_t tx_ts[CAN_NUM_MB];
+/* mailbox owner while the software queue is held back, see can_tx_claim() */
+static void (*volatile tx_hook)(int mb, int ok, uint32_t now);
+static volatile uint8_t tx_staged;	/* loaded, TXRQ not set yet */
+static volatile uint8_t tx_abort;	/* ABRQ set by can_xmit_cancel() */
+/* can_xmit_tagged() frames: tags by queue slot and by mailbox */
+static uint32_t tx_tag[TX_QUEUE_LEN];
+static uint32_t mb_tag[CAN_NUM_MB] = {
+	CAN_TX_NOTAG,
+	CAN_TX_NOTAG,
+	CAN_TX_NOTAG,
+};
+static void (*volatile tx_done)(uint32_t tag, int ok, uint32_t now,
+				BaseType_t *woken);
 
 unsigned int can_id = 0;
-static int dump_packets = 1;
+static int dump_mode = CAN_DUMP_TEXT;
+static volatile TaskHandle_t dump_task;
+
+unsigned int can_bitrate = CAN_BITRATE_DFL;
+static int can_listen;
+/* bit timing: prescaler, BS1, BS2, SJW in tq */
+static struct {
+	int presc, bs1, bs2, sjw;
+} can_bt;
 
 static volatile struct can_stat can_stat;
 
@@ -38,8 +85,15 @@ struct can_stat *can_stat_get()
 
 void can_stat_dump()
 {
-	printf("TX: %d (%d B)\r\n", can_stat.csent, can_stat.bsent);
-	printf("RX: %d (%d B)\r\n", can_stat.crecv, can_stat.brecv);
+	xprintf("TX: %d (%d B)\r\n", can_stat.csent, can_stat.bsent);
+	xprintf("RX: %d (%d B)\r\n", can_stat.crecv, can_stat.brecv);
+	xprintf("RX overruns: %d\r\n", can_stat.rxovr);
+	xprintf("Dump dropped: %d\r\n", can_stat.dumpdrop);
+	xprintf("Last RX: %u us\r\n", can_stat.rx_ts);
+	xprintf("Last TX: %u us\r\n", can_stat.tx_ts);
+	xprintf("TX queue full: %d\r\n", can_stat.txfull);
+	xprintf("TX errors: %d\r\n", can_stat.txerr);
+	xprintf("TX aborted: %d\r\n", can_stat.txabort);
 }
 
 static int can_ping_reply(CanRxMsg *rx_msg)
@@ -58,9 +112,9 @@ static int can_ping_reply(CanRxMsg *rx_msg)
 }
 
 
-void can_dump_pkt(int on)
+void can_dump_pkt(int mode)
 {
-	dump_packets = on;
+	dump_mode = mode;
 }
 
 static void NVIC_Config(void)
@@ -77,13 +131,120 @@ static void NVIC_Config(void)
 #endif
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init(&NVIC_InitStructure);
+#ifdef TARGET_F407
+	/* F091 shares a single vector for RX and TX */
+	NVIC_InitStructure.NVIC_IRQChannel = CAN_TX_IRQ;
+	NVIC_Init(&NVIC_InitStructure);
+	NVIC_InitStructure.NVIC_IRQChannel = CAN_SCE_IRQ;
+	NVIC_Init(&NVIC_InitStructure);
+#endif
+}
+
+/*
+ * Find bit timing for `bps`: a bit of 6..25 tq that the CAN clock
+ * divides exactly, sampled as close to 87.5% as BS2 = tq/8 (rounded, at
+ * least 1) allows, the CiA recommendation most nodes use. Of equally
+ * close ones the longest bit wins. Returns the prescaler, 0 if there is
+ * no exact timing.
+ */
+static int can_bit_timing(unsigned int bps, int *bs1, int *bs2)
+{
+	int tq, b2, err, best = -1, best_err = 1000;
+
+	if (bps == 0)
+		return 0;
+	for (tq = 25; tq >= 6; tq--) {
+		if (CAN_CLK_HZ % (bps * tq))
+			continue;
+		if (CAN_CLK_HZ / (bps * tq) > 1024)
+			continue;
+		b2 = (tq + 4) / 8;
+		if (b2 < 1)
+			b2 = 1;
+		if (tq - 1 - b2 > 16)
+			continue;
+		/* sample point error, permille */
+		err = (tq - b2) * 1000 / tq - 875;
+		if (err < 0)
+			err = -err;
+		if (err < best_err) {
+			best = tq;
+			best_err = err;
+			*bs2 = b2;
+			*bs1 = tq - 1 - b2;
+		}
+	}
+	return best < 0 ? 0 : CAN_CLK_HZ / (bps * best);
+}
+
+static int can_cell_init(void)
+{
+	CAN_InitTypeDef CAN_InitStructure;
+
+	/* stamp SOF of every RX frame and TX completion */
+	CAN_InitStructure.CAN_TTCM = ENABLE;
+	CAN_InitStructure.CAN_ABOM = DISABLE;
+	CAN_InitStructure.CAN_AWUM = DISABLE;
+	CAN_InitStructure.CAN_NART = DISABLE;
+	CAN_InitStructure.CAN_RFLM = DISABLE;
+	CAN_InitStructure.CAN_TXFP = DISABLE;
+	CAN_InitStructure.CAN_Mode = can_listen ? CAN_Mode_Silent : CAN_Mode_Normal;
+	CAN_InitStructure.CAN_SJW = can_bt.sjw - 1;
+	CAN_InitStructure.CAN_Prescaler = can_bt.presc;
+	CAN_InitStructure.CAN_BS1 = can_bt.bs1 - 1;
+	CAN_InitStructure.CAN_BS2 = can_bt.bs2 - 1;
+	if (CAN_Init(CANx, &CAN_InitStructure) != CAN_InitStatus_Success)
+		return -1;
+	return 0;
+}
+
+/*
+ * Switch the bus bitrate. Pending frames are dropped, filters and
+ * interrupt enables survive re-initialization.
+ * Returns -1 if the CAN clock cannot produce `bps` exactly.
+ */
+int can_set_bitrate(unsigned int bps)
+{
+	int presc, bs1, bs2;
+
+	presc = can_bit_timing(bps, &bs1, &bs2);
+	if (!presc)
+		return -1;
+	return can_set_timing(presc, bs1, bs2, 1);
+}
+
+/*
+ * Set the bit timing directly, all values in tq except the prescaler.
+ * Returns -1 if they are out of the controller's range.
+ */
+int can_set_timing(int presc, int bs1, int bs2, int sjw)
+{
+	if (presc < 1 || presc > 1024 || bs1 < 1 || bs1 > 16 ||
+	    bs2 < 1 || bs2 > 8 || sjw < 1 || sjw > 4)
+		return -1;
+	can_xmit_cancel();
+	can_bt.presc = presc;
+	can_bt.bs1 = bs1;
+	can_bt.bs2 = bs2;
+	can_bt.sjw = sjw;
+	if (can_cell_init())
+		return -1;
+	can_bitrate = CAN_CLK_HZ / (presc * (1 + bs1 + bs2));
+	return 0;
+}
+
+/* Silent mode: receive only, no ACK or error frames on the bus */
+void can_set_listen(int on)
+{
+	can_xmit_cancel();
+	can_listen = on;
+	can_cell_init();
 }
 
 static void CAN_Config(void)
 {
 	GPIO_InitTypeDef  GPIO_InitStructure;
-	CAN_InitTypeDef        CAN_InitStructure;
-	CAN_FilterInitTypeDef  CAN_FilterInitStructure;
+	int i;
 
 	/* CAN GPIOs configuration */
 
@@ -115,52 +276,71 @@ static void CAN_Config(void)
 	CAN_DeInit(CANx);
 
 	/* CAN cell init */
-	CAN_InitStructure.CAN_TTCM = DISABLE;
-	CAN_InitStructure.CAN_ABOM = DISABLE;
-	CAN_InitStructure.CAN_AWUM = DISABLE;
-	CAN_InitStructure.CAN_NART = DISABLE;
-	CAN_InitStructure.CAN_RFLM = DISABLE;
-	CAN_InitStructure.CAN_TXFP = DISABLE;
-	CAN_InitStructure.CAN_Mode = CAN_Mode_Normal;
-	CAN_InitStructure.CAN_SJW = CAN_SJW_1tq;
-#ifdef TARGET_F407
-	CAN_InitStructure.CAN_Prescaler = 7;
-#endif
-#ifdef TARGET_F091
-	CAN_InitStructure.CAN_Prescaler = 8;
-#endif
-	/* 1Mb */
-	CAN_InitStructure.CAN_BS1 = CAN_BS1_2tq;
-	CAN_InitStructure.CAN_BS2 = CAN_BS2_3tq;
-	CAN_Init(CANx, &CAN_InitStructure);
+	can_bt.presc = can_bit_timing(can_bitrate, &can_bt.bs1, &can_bt.bs2);
+	can_bt.sjw = 1;
+	can_cell_init();
+
+	/*
+	 * TDTR resets to an undefined value and CAN_Transmit() preserves
+	 * TGT: with TTCM on it would overwrite the last two payload bytes.
+	 */
+	for (i = 0; i < CAN_NUM_MB; i++)
+		CANx->sTxMailBox[i].TDTR = 0;
 
 	/* CAN filter init */
 	can_filter_setup(can_id, 0);
 
-	/* Enable FIFO 0 message pending Interrupt */
-	CAN_ITConfig(CANx, CAN_IT_FMP0, ENABLE);
+	/* Enable FIFO 0 message pending and TX mailbox empty Interrupts */
+	CAN_ITConfig(CANx, CAN_IT_FMP0 | CAN_IT_TME, ENABLE);
 }
 
 void can_init()
 {
 	can_stat_reset();
-	queue_init(&rx_queue, sizeof(rx_msg[0]), RX_QUEUE_LEN, &rx_msg[0]);
-	queue_init(&rx_queue_isr, sizeof(rx_msg_isr[0]), RX_QUEUE_LEN, &rx_msg_isr[0]);
+	ring_init(&rx_ring);
+	ring_init(&dump_ring);
+	can_load_init();
 	NVIC_Config();
 	CAN_Config();
 };
 
-int can_recv(unsigned char *msg)
+/*
+ * Wait up to `timeout` ticks for a frame and copy it to `f`.
+ * Returns -1 on timeout. Only one task may receive: the ring has a
+ * single consumer. Other notifications to the task end the wait early,
+ * a zero `timeout` polls and leaves pending notifications alone.
+ */
+int can_recv_frame(struct can_frame *f, TickType_t timeout)
 {
-	CanRxMsg cmsg;
-	int ret = -1;
+	rx_task = xTaskGetCurrentTaskHandle();
+	if (ring_empty(&rx_ring) && timeout)
+		ulTaskNotifyTake(pdTRUE, timeout);
+	if (ring_empty(&rx_ring))
+		return -1;
+	*f = *ring_tail(&rx_ring);
+	ring_pop(&rx_ring);
+	TRACE(TRACE_MARK, TRACE_MARK_RX_TAKE, CAN_FRAME_STDID(f));
+	return 0;
+}
 
-	while (queue_pop(&rx_queue, &cmsg)) {
-		vTaskDelay(1);
-		queue_swap(&rx_queue, &rx_queue_isr);
-	}
-	memcpy(msg, cmsg.Data, cmsg.DLC);
-	return cmsg.DLC;
+/*
+ * Block until a frame arrives, copy its payload to `msg` and, if `ts`
+ * is not NULL, its receive timestamp in us.
+ */
+int can_recv(unsigned char *msg, uint32_t *ts)
+{
+	struct can_frame f;
+	int len;
+
+	while (can_recv_frame(&f, portMAX_DELAY))
+		;
+	len = CAN_FRAME_DLC(&f);
+	if (len > 8)
+		len = 8;
+	memcpy(msg, f.data, len);
+	if (ts)
+		*ts = f.ts;
+	return len;
 }
 
 void can_filter_setup(unsigned int id, unsigned int mask)
@@ -183,27 +363,259 @@ void can_filter_setup(unsigned int id, unsigned int mask)
 	CAN_FilterInit(&filter);
 }
 
-void can_xmit(unsigned int id, unsigned char *data, int len)
+/*
+ * Edits of the software RX filter, in place: the RX interrupt keeps
+ * counting hits of the rules that stay. Rules are compiled beforehand,
+ * interrupts are only masked for the copy into the rule table.
+ */
+int can_rx_filter_add(const struct filter_rule *r)
+{
+	int ret;
+
+	taskENTER_CRITICAL();
+	ret = filter_add(&rx_filter, r);
+	taskEXIT_CRITICAL();
+	return ret;
+}
+
+int can_rx_filter_del(int idx)
+{
+	int ret;
+
+	taskENTER_CRITICAL();
+	ret = filter_del(&rx_filter, idx);
+	taskEXIT_CRITICAL();
+	return ret;
+}
+
+void can_rx_filter_default(int action)
+{
+	taskENTER_CRITICAL();
+	rx_filter.dfl = action;
+	taskEXIT_CRITICAL();
+}
+
+void can_rx_filter_clear()
 {
-	CanTxMsg TxMessage;
+	taskENTER_CRITICAL();
+	filter_init(&rx_filter);
+	taskEXIT_CRITICAL();
+}
+
+/* Snapshot of the software RX filter and its counters, rule by rule */
+void can_rx_filter_get(struct filter *fl)
+{
+	int i;
+
+	taskENTER_CRITICAL();
+	fl->nrules = rx_filter.nrules;
+	fl->dfl = rx_filter.dfl;
+	fl->dfl_hits = rx_filter.dfl_hits;
+	taskEXIT_CRITICAL();
+	for (i = 0; i < fl->nrules; i++) {
+		taskENTER_CRITICAL();
+		fl->rule[i] = rx_filter.rule[i];
+		taskEXIT_CRITICAL();
+	}
+}
+
+/* Move queued frames into free mailboxes, CAN TX interrupt must be masked */
+static void can_tx_fill(void)
+{
+	uint8_t mb;
+
+	if (tx_hook)
+		return;
+	while (tx_out != tx_in) {
+		mb = CAN_Transmit(CANx, &tx_msg[tx_out & (TX_QUEUE_LEN - 1)]);
+		if (mb == CAN_TxStatus_NoMailBox)
+			break;
+		mb_tag[mb] = tx_tag[tx_out & (TX_QUEUE_LEN - 1)];
+		tx_out++;
+	}
+}
+
+/* `ir` is laid out as TIR/RIR: STID or EXID, IDE, RTR */
+static int can_tx_push(uint32_t ir, unsigned char *data, int len,
+		       uint32_t tag)
+{
+	CanTxMsg *m;
+
+	if (len > 8)
+		len = 8;
+
+	taskENTER_CRITICAL();
+	if (tx_in - tx_out >= TX_QUEUE_LEN) {
+		taskEXIT_CRITICAL();
+		return -1;
+	}
+	m = &tx_msg[tx_in & (TX_QUEUE_LEN - 1)];
+	m->StdId = ir >> 21;
+	m->ExtId = (ir >> 3) & 0x1fffffff;
+	m->DLC = len;
+	m->RTR = ir & CAN_RTR_REMOTE;
+	m->IDE = ir & CAN_ID_EXT;
+	if (m->RTR == CAN_RTR_DATA)
+		memcpy(m->Data, data, len);
+	tx_tag[tx_in & (TX_QUEUE_LEN - 1)] = tag;
+	tx_in++;
+	TRACE(TRACE_MARK, TRACE_MARK_XMIT, ir >> 21);
+	can_stat.csent += 1;
+	can_stat.bsent += len;
+	can_tx_fill();
+	taskEXIT_CRITICAL();
+	return 0;
+}
 
+/*
+ * Queue a frame for transmission without blocking.
+ * Returns 0 on success, -1 if the TX queue is full.
+ */
+int can_xmit(unsigned int id, unsigned char *data, int len)
+{
 #ifdef TARGET_F407
 	led_on(&f4d_led_orange);
 #endif
-	can_stat.csent += 1;
-	can_stat.bsent += len;
+	if (can_tx_push((id & 0x7ff) << 21, data, len, CAN_TX_NOTAG)) {
+		can_stat.txfull += 1;
+		return -1;
+	}
+	return 0;
+}
 
-	id &= 0x7ff;
-	TxMessage.StdId = id;
-	TxMessage.ExtId = id;
-	TxMessage.DLC = len;
-	TxMessage.RTR = CAN_RTR_DATA;
-	TxMessage.IDE = CAN_ID_STD;
-	if (len > 8)
-		len = 8;
-	memcpy(TxMessage.Data, data, len);
-	while (CAN_Transmit(CANx, &TxMessage) == CAN_TxStatus_NoMailBox)
-		;
+/*
+ * Queue an arbitrary frame without blocking, `ir` as in struct
+ * can_frame. Returns 0 on success, -1 if the TX queue is full.
+ */
+int can_xmit_frame(uint32_t ir, unsigned char *data, int len)
+{
+	return can_xmit_tagged(ir, data, len, CAN_TX_NOTAG);
+}
+
+/*
+ * Same, and have the can_tx_notify() callback report the outcome with
+ * `tag`: once from the TX interrupt when the mailbox completes, or from
+ * can_xmit_cancel() if the frame is dropped before reaching one.
+ */
+int can_xmit_tagged(uint32_t ir, unsigned char *data, int len, uint32_t tag)
+{
+	if (can_tx_push(ir & ~1, data, len, tag)) {
+		can_stat.txfull += 1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Set the completion callback of can_xmit_tagged(), ISR context. One
+ * user at a time: task_gs, or `ping` while it runs.
+ */
+void can_tx_notify(void (*done)(uint32_t tag, int ok, uint32_t now,
+				BaseType_t *woken))
+{
+	taskENTER_CRITICAL();
+	tx_done = done;
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * Queue a frame, sleeping until the TX interrupt frees a slot. `tag` is
+ * reported as with can_xmit_tagged(), CAN_TX_NOTAG for none.
+ * Returns -1 if the queue is still full after `timeout` ticks.
+ */
+int can_xmit_wait(unsigned int id, unsigned char *data, int len,
+		  TickType_t timeout, uint32_t tag)
+{
+	TickType_t tim = xTaskGetTickCount();
+
+#ifdef TARGET_F407
+	led_on(&f4d_led_orange);
+#endif
+	while (can_tx_push((id & 0x7ff) << 21, data, len, tag)) {
+		if (xTaskGetTickCount() - tim >= timeout) {
+			can_stat.txfull += 1;
+			return -1;
+		}
+		tx_waiter = xTaskGetCurrentTaskHandle();
+		if (tx_in - tx_out < TX_QUEUE_LEN)
+			continue;
+		/* bounded wait: the other waiter may have taken the wakeup */
+		ulTaskNotifyTake(pdTRUE, 1);
+	}
+	return 0;
+}
+
+/* Drop queued frames and abort the pending mailboxes */
+void can_xmit_cancel()
+{
+	uint32_t tag;
+	int i;
+
+	taskENTER_CRITICAL();
+	for (; tx_out != tx_in; tx_out++) {
+		tag = tx_tag[tx_out & (TX_QUEUE_LEN - 1)];
+		if (tag != CAN_TX_NOTAG && tx_done)
+			tx_done(tag, 0, timebase_now(), NULL);
+	}
+	for (i = 0; i < CAN_NUM_MB; i++) {
+		/* ABRQ is gone by the time the mailbox completes */
+		if (!(CANx->TSR & (CAN_TSR_TME0 << i)))
+			tx_abort |= 1 << i;
+		CAN_CancelTransmit(CANx, i);
+	}
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * Take the TX mailboxes over, e.g. for trace replay: the software queue is
+ * held back and `done` is called from the TX interrupt for every mailbox
+ * that completes. The owner loads mailboxes with can_mb_stage() and
+ * starts them with can_mb_fire(), both with the CAN interrupts masked.
+ */
+void can_tx_claim(void (*done)(int mb, int ok, uint32_t now))
+{
+	taskENTER_CRITICAL();
+	tx_staged = 0;
+	tx_hook = done;
+	taskEXIT_CRITICAL();
+}
+
+void can_tx_release()
+{
+	taskENTER_CRITICAL();
+	tx_hook = NULL;
+	tx_staged = 0;
+	can_tx_fill();
+	taskEXIT_CRITICAL();
+}
+
+/* Load a frame into an empty mailbox without requesting it, -1 if none */
+int can_mb_stage(uint32_t ir, const uint8_t *data, int len)
+{
+	CAN_TxMailBox_TypeDef *mb;
+	int i;
+
+	for (i = 0; i < CAN_NUM_MB; i++)
+		if ((CANx->TSR & (CAN_TSR_TME0 << i)) && !(tx_staged & (1 << i)))
+			break;
+	if (i == CAN_NUM_MB)
+		return -1;
+	mb = &CANx->sTxMailBox[i];
+	mb->TIR = ir & ~CAN_TI0R_TXRQ;
+	mb->TDTR = len & 0xf;
+	mb->TDLR = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+	mb->TDHR = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+	tx_staged |= 1 << i;
+	return i;
+}
+
+/* Start a staged mailbox, a single register write */
+void can_mb_fire(int mb)
+{
+	CANx->sTxMailBox[mb].TIR |= CAN_TI0R_TXRQ;
+	tx_staged &= ~(1 << mb);
+	can_stat.csent += 1;
+	can_stat.bsent += CANx->sTxMailBox[mb].TDTR & 0xf;
 }
 
 void can_dump_tx()
@@ -211,56 +623,406 @@ void can_dump_tx()
 	int i;
 
 	for (i = 0; i < CAN_NUM_MB; i++) {
-		printf("MB #%d\r\n", i);
-		printf("TxStatus: ");
-		switch(CAN_TransmitStatus(CANx, i)) {
+		xprintf("MB #%d\r\n", i);
+		xprintf("TxTime: %u us (%u)\r\n", tx_ts[i],
+		       CANx->sTxMailBox[i].TDTR >> 16);
+		xprintf("TxStatus: ");
+		if (!(CANx->TSR & (CAN_TSR_TME0 << i))) {
+			xprintf("PENDING\r\n");
+			continue;
+		}
+		switch(tx_status[i]) {
 		case CAN_TxStatus_Ok:
-			printf("OK");
+			xprintf("OK");
 			break;
 		case CAN_TxStatus_Pending:
-			printf("PENDING");
+			xprintf("PENDING");
 			break;
 		case CAN_TxStatus_Failed:
-			printf("FAILED");
+			xprintf("FAILED");
+			break;
+		default:
+			xprintf("EMPTY");
 			break;
 		}
-		printf("\r\n");
+		xprintf("\r\n");
 	}
-	printf("TEC: %d\r\n", CAN_GetLSBTransmitErrorCounter(CANx));
-	printf("REC: %d\r\n", CAN_GetReceiveErrorCounter(CANx));
-	printf("LEC: %d\r\n", CAN_GetLastErrorCode(CANx));
-	
+	xprintf("TEC: %d\r\n", CAN_GetLSBTransmitErrorCounter(CANx));
+	xprintf("REC: %d\r\n", CAN_GetReceiveErrorCounter(CANx));
+	xprintf("LEC: %d\r\n", CAN_GetLastErrorCode(CANx));
+	xprintf("TXQ: %d/%d\r\n", tx_in - tx_out, TX_QUEUE_LEN);
+}
+
+static void can_tx_isr(BaseType_t *woken)
+{
+	CAN_TxMailBox_TypeDef *mb;
+	uint32_t tsr, now, dw[2];
+	int i;
+
+	now = timebase_now();
+	tsr = CANx->TSR;
+	for (i = 0; i < CAN_NUM_MB; i++) {
+		if (!(tsr & (CAN_TSR_RQCP0 << (8 * i))))
+			continue;
+		tx_ts[i] = now;
+		can_stat.tx_ts = now;
+		if (tsr & (CAN_TSR_TXOK0 << (8 * i))) {
+			tx_status[i] = CAN_TxStatus_Ok;
+			/* bus load: whatever made it to the wire, replay included */
+			mb = &CANx->sTxMailBox[i];
+			dw[0] = mb->TDLR;
+			dw[1] = mb->TDHR;
+			can_load_add(now, can_frame_bits(mb->TIR, mb->TDTR & 0xf,
+							 (uint8_t *)dw));
+		} else {
+			tx_status[i] = CAN_TxStatus_Failed;
+			if (tx_abort & (1 << i))
+				can_stat.txabort += 1;
+			else
+				can_stat.txerr += 1;
+		}
+		tx_abort &= ~(1 << i);
+		TRACE(TRACE_MARK, TRACE_MARK_TX_DONE, i);
+		if (mb_tag[i] != CAN_TX_NOTAG && tx_done)
+			tx_done(mb_tag[i], tx_status[i] == CAN_TxStatus_Ok, now,
+				woken);
+		mb_tag[i] = CAN_TX_NOTAG;
+		if (tx_hook)
+			tx_hook(i, tx_status[i] == CAN_TxStatus_Ok, now);
+	}
+	/* RQCPx are write-1-to-clear, this also clears TXOK/ALST/TERR */
+	CANx->TSR = tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2);
+
+	can_tx_fill();
+
+	if (tx_waiter && tx_in - tx_out < TX_QUEUE_LEN) {
+		vTaskNotifyGiveFromISR(tx_waiter, woken);
+		tx_waiter = NULL;
+	}
+}
+
+/*
+ * Per frame work of the RX interrupt on `f`, the RX ring head or `spill`
+ * when the ring is full. Returns 1 if the frame was queued. Forced
+ * inline so that sharing it with can_bench_rx() costs the ISR nothing.
+ */
+static inline __attribute__((always_inline))
+int can_rx_frame(struct can_frame *f, struct can_frame *spill)
+{
+	int act;
+
+	/* bus load: every frame on the wire, dropped or not */
+	can_load_add(f->ts, can_frame_bits(f->ir, CAN_FRAME_DLC(f), f->data));
+	act = filter_run(&rx_filter,
+			 f->ir & CAN_ID_EXT ? CAN_FRAME_EXTID(f) :
+					      CAN_FRAME_STDID(f),
+			 (f->ir & CAN_ID_EXT ? FILTER_EXT : 0) |
+			 (f->ir & CAN_RTR_REMOTE ? FILTER_RTR : 0),
+			 CAN_FRAME_DLC(f), f->data);
+	if (act & FILTER_CAPTURE)
+		capture_frame(f);
+	/* dropped: the ring slot is reused for the next frame */
+	if (!(act & FILTER_QUEUE))
+		return 0;
+	if (f == spill) {
+		can_stat.rxovr += 1;
+		return 0;
+	}
+	if (dump_mode) {
+		if (ring_full(&dump_ring)) {
+			can_stat.dumpdrop += 1;
+		} else {
+			*ring_head(&dump_ring) = *f;
+			ring_push(&dump_ring);
+		}
+	}
+	can_stat.crecv += 1;
+	can_stat.brecv += CAN_FRAME_DLC(f);
+	ring_push(&rx_ring);
+	TRACE(TRACE_MARK, TRACE_MARK_RX, CAN_FRAME_STDID(f));
+	return 1;
+}
+
+/*
+ * Drain FIFO 0 straight from the mailbox registers into the ring slot,
+ * bypassing CAN_Receive() and its intermediate CanRxMsg.
+ */
+static void can_rx_isr(BaseType_t *woken)
+{
+	CAN_FIFOMailBox_TypeDef *mb = &CANx->sFIFOMailBox[CAN_FIFO0];
+	struct can_frame *f, spill;
+	uint32_t now;
+	int n = 0;
+
+	now = timebase_now();
+#ifdef TARGET_F407
+	led_on(&f4d_led_green);
+#endif
+	while (CANx->RF0R & CAN_RF0R_FMP0) {
+		/* a full ring still gets the frame read for the capture */
+		f = ring_full(&rx_ring) ? &spill : ring_head(&rx_ring);
+		f->ir = mb->RIR;
+		f->dtr = mb->RDTR;
+		f->dw[0] = mb->RDLR;
+		f->dw[1] = mb->RDHR;
+		f->ts = now;
+		CANx->RF0R = CAN_RF0R_RFOM0;
+		n += can_rx_frame(f, &spill);
+	}
+	/* hardware FIFO overrun: frames lost before we got to them */
+	if (CANx->RF0R & CAN_RF0R_FOVR0) {
+		CANx->RF0R = CAN_RF0R_FOVR0;
+		can_stat.rxovr += 1;
+	}
+	if (n)
+		can_stat.rx_ts = now;
+	if (n && rx_task)
+		vTaskNotifyGiveFromISR(rx_task, woken);
+	/* don't wait for the period once half the dump ring is used */
+	if (n && dump_task && ring_len(&dump_ring) >= DUMP_QUEUE_LEN / 2)
+		vTaskNotifyGiveFromISR(dump_task, woken);
+}
+
+/* Enable error (LEC) interrupts, for capturing error events */
+void can_err_irq(int on)
+{
+	CAN_ITConfig(CANx, CAN_IT_ERR | CAN_IT_LEC, on ? ENABLE : DISABLE);
+}
+
+static void can_err_isr(void)
+{
+	uint32_t esr = CANx->ESR;
+
+	/* LEC is the only writable field, 0 rearms the error detection */
+	CANx->ESR = 0;
+	CANx->MSR = CAN_MSR_ERRI;
+	if (esr & CAN_ESR_LEC)
+		capture_error(esr, timebase_now());
+}
+
+static int can_dump_slcan(char *buf, struct can_frame *f, int mode)
+{
+	struct slcan_frame sf;
+
+	sf.ext = !!(f->ir & CAN_ID_EXT);
+	sf.rtr = !!(f->ir & CAN_RTR_REMOTE);
+	sf.id = sf.ext ? CAN_FRAME_EXTID(f) : CAN_FRAME_STDID(f);
+	sf.dlc = CAN_FRAME_DLC(f);
+	memcpy(sf.data, f->data, 8);
+	return slcan_format_frame(buf, &sf,
+				  mode & CAN_DUMP_TS ? (int)(f->ts / 1000 % 60000) : -1);
+}
+
+#define DUMP_PUTS(p, s)	(memcpy(p, s, sizeof(s) - 1), (p) += sizeof(s) - 1)
+
+/* `dump on` text, built from the fmt fast paths (no varargs, no division) */
+static int can_dump_text(char *buf, struct can_frame *f)
+{
+	char *p = buf;
+	int i, dlc = CAN_FRAME_DLC(f);
+
+	DUMP_PUTS(p, "\r\nCAN packet received\r\nStdId: ");
+	p += fmt_hex(p, CAN_FRAME_STDID(f), 0);
+	DUMP_PUTS(p, "\r\nExtId: ");
+	p += fmt_hex(p, CAN_FRAME_EXTID(f), 0);
+	DUMP_PUTS(p, "\r\npayload(");
+	p += fmt_udec(p, dlc);
+	DUMP_PUTS(p, "): ");
+	for (i = 0; i < dlc && i < 8; i++) {
+		*p++ = ' ';
+		p += fmt_hex(p, f->data[i], 2);
+	}
+	DUMP_PUTS(p, "\r\n");
+	return p - buf;
+}
+
+/*
+ * Format frames queued by the RX ISR while `dump` is on. Runs at low
+ * priority and emits each batch with a single write.
+ */
+void task_dump(void *vpars)
+{
+	char buf[DUMP_BATCH * 96 + 48];
+	struct can_frame *f;
+	unsigned int drop, dropped = 0;
+	int n, cnt, mode;
+
+	dump_task = xTaskGetCurrentTaskHandle();
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, DUMP_PERIOD);
+		do {
+			n = 0;
+			mode = dump_mode;
+			for (cnt = 0; cnt < DUMP_BATCH && !ring_empty(&dump_ring); cnt++) {
+				f = ring_tail(&dump_ring);
+				if (mode & CAN_DUMP_SLCAN) {
+					n += can_dump_slcan(buf + n, f, mode);
+					ring_pop(&dump_ring);
+					continue;
+				}
+				n += can_dump_text(buf + n, f);
+				ring_pop(&dump_ring);
+			}
+			drop = can_stat.dumpdrop;
+			/* `stat reset` zeroed the counter under us */
+			if (drop < dropped)
+				dropped = 0;
+			/* SLCAN hosts would choke on free text */
+			if (drop != dropped && !(mode & CAN_DUMP_SLCAN)) {
+				n += xsnprintf(buf + n, sizeof(buf) - n,
+					       "dump: %u frames dropped\r\n",
+					       drop - dropped);
+				dropped = drop;
+			}
+			if (n)
+				xwrite(buf, n);
+		} while (cnt == DUMP_BATCH);
+	}
+}
+
+/*
+ * `bench`: the real code paths, run `n` times on a synthetic frame
+ * inside a critical section, with their side effects rolled back before
+ * it ends: rings, statistics, filter hits and bus load. The trace
+ * recorder is paused, its events could not be taken back. `t` gets the
+ * elapsed prof_now() time.
+ */
+static void tx_bench_hook(int mb, int ok, uint32_t now)
+{
+}
+
+int can_bench_xmit(int n, uint32_t *t)
+{
+	static unsigned char data[8];
+	void (*hook)(int mb, int ok, uint32_t now);
+	struct can_stat st;
+	unsigned int in;
+	uint32_t t0, mask;
+
+	taskENTER_CRITICAL();
+	if (TX_QUEUE_LEN - (tx_in - tx_out) < n) {
+		taskEXIT_CRITICAL();
+		return -1;
+	}
+	/*
+	 * Keep the frames out of the mailboxes: they never complete, so
+	 * they are not accounted as bus load either.
+	 */
+	hook = tx_hook;
+	tx_hook = tx_bench_hook;
+	in = tx_in;
+	mask = trace_mask;
+	trace_mask = 0;
+	memcpy(&st, (void *)&can_stat, sizeof(st));
+	t0 = prof_now();
+	while (n--)
+		can_xmit(0x7ff, data, sizeof(data));
+	*t = prof_now() - t0;
+	memcpy((void *)&can_stat, &st, sizeof(st));
+	trace_mask = mask;
+	tx_in = in;
+	tx_hook = hook;
+	taskEXIT_CRITICAL();
+	return 0;
+}
+
+int can_bench_rx(const struct can_frame *f, int n, uint32_t *t)
+{
+	static struct can_frame spill;
+	static struct can_load_state load;
+	uint32_t hits[FILTER_RULES + 1], t0, mask;
+	struct can_stat st;
+	struct can_frame *h;
+	unsigned int rx_in, dump_in;
+	int i;
+
+	taskENTER_CRITICAL();
+	mask = trace_mask;
+	trace_mask = 0;
+	can_load_save(&load);
+	memcpy(&st, (void *)&can_stat, sizeof(st));
+	for (i = 0; i < rx_filter.nrules; i++)
+		hits[i] = rx_filter.rule[i].hits;
+	hits[i] = rx_filter.dfl_hits;
+	rx_in = rx_ring.in;
+	dump_in = dump_ring.in;
+	t0 = prof_now();
+	while (n--) {
+		h = ring_full(&rx_ring) ? &spill : ring_head(&rx_ring);
+		*h = *f;
+		can_rx_frame(h, &spill);
+		rx_ring.in = rx_in;
+		dump_ring.in = dump_in;
+	}
+	*t = prof_now() - t0;
+	for (i = 0; i < rx_filter.nrules; i++)
+		rx_filter.rule[i].hits = hits[i];
+	rx_filter.dfl_hits = hits[i];
+	memcpy((void *)&can_stat, &st, sizeof(st));
+	can_load_restore(&load);
+	trace_mask = mask;
+	taskEXIT_CRITICAL();
+	return 0;
+}
+
+int can_bench_dump(const struct can_frame *f, int n, uint32_t *t)
+{
+	static char buf[96];
+	struct can_frame fr = *f;
+	uint32_t t0;
+
+	t0 = prof_now();
+	while (n--) {
+		can_dump_text(buf, &fr);
+		ring_barrier();
+	}
+	*t = prof_now() - t0;
+	return 0;
 }
 
 #ifdef TARGET_F407
 void CAN1_RX0_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_CAN_RX);
+
+	can_rx_isr(&woken);
+	prof_isr_exit(PROF_IRQ_CAN_RX, t0);
+	portEND_SWITCHING_ISR(woken);
+}
+
+void CAN1_TX_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_CAN_TX);
+
+	can_tx_isr(&woken);
+	prof_isr_exit(PROF_IRQ_CAN_TX, t0);
+	portEND_SWITCHING_ISR(woken);
+}
+
+void CAN1_SCE_IRQHandler(void)
+{
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_CAN_SCE);
+
+	can_err_isr();
+	prof_isr_exit(PROF_IRQ_CAN_SCE, t0);
+}
 #endif
+
 #ifdef TARGET_F091
 void CEC_CAN_IRQHandler(void)
-#endif
 {
-	CanRxMsg RxMessage;
+	BaseType_t woken = pdFALSE;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_CAN);
 
-#ifdef TARGET_F407
-	led_on(&f4d_led_green);
-#endif
-	while (CAN_MessagePending(CANx, CAN_FIFO0)) {
-		CAN_Receive(CANx, CAN_FIFO0, &RxMessage);
-		if (dump_packets) {
-			int i;
-			printf("\r\nCAN packet received\r\n");
-			printf("StdId: %x\r\n", RxMessage.StdId);
-			printf("ExtId: %x\r\n", RxMessage.ExtId);
-			printf("payload(%d): ", RxMessage.DLC);
-			for (i = 0; i < RxMessage.DLC; i++)
-				printf(" %02x", RxMessage.Data[i]);
-			printf("\r\n");
-		}
-		if (queue_push(&rx_queue_isr, &RxMessage))
-			return;
-		else {
-			can_stat.crecv += 1;
-			can_stat.brecv += RxMessage.DLC;
-		}
-	}
+	if (CANx->TSR & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2))
+		can_tx_isr(&woken);
+	if (CANx->RF0R & CAN_RF0R_FMP0)
+		can_rx_isr(&woken);
+	if (CANx->MSR & CAN_MSR_ERRI)
+		can_err_isr();
+	prof_isr_exit(PROF_IRQ_CAN, t0);
+	portEND_SWITCHING_ISR(woken);
 }
+#endif
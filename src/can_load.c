@@ -0,0 +1,219 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "can.h"
+#include "can_load.h"
+#include "timebase.h"
+#include "fmt.h"
+
+/*
+ * Bits seen on the wire per LOAD_BIN_US. A bin is indexed by its start
+ * time, so the ISR path needs only shifts and masks; bin_ts is the start
+ * of the newest bin.
+ */
+static uint16_t bins[LOAD_BINS];
+static uint32_t bin_ts;
+
+#define LOAD_WIN(us)	(((us) + LOAD_BIN_US / 2) >> LOAD_BIN_SHIFT)
+static const unsigned int windows[3] = {
+	LOAD_WIN(10000), LOAD_WIN(100000), LOAD_WIN(1000000)
+};
+
+/*
+ * Stuffing state: the last bit and how many equal ones it ends (1..4),
+ * as last << 2 | (run - 1). A fifth equal bit is stuffed right away.
+ */
+struct bitstream {
+	uint16_t crc;
+	uint8_t st;
+	int bits;
+};
+
+/* CRC-15 of four bits, and new state plus stuff bit count per nibble */
+static uint16_t crc_tab[16];
+static uint8_t stuff_tab[8][16];
+
+/*
+ * Feed one bit. Bits up to the end of the data field are covered by the
+ * CRC, all of them up to the end of the CRC are subject to stuffing:
+ * after five equal bits a complementary one is inserted and itself
+ * starts the next run.
+ */
+static void bs_bit(struct bitstream *bs, int b, int crc)
+{
+	if (crc) {
+		/* CRC-15/CAN: x^15 + x^14 + x^10 + x^8 + x^7 + x^4 + x^3 + 1 */
+		if (b ^ (bs->crc >> 14))
+			bs->crc = ((bs->crc << 1) ^ 0x4599) & 0x7fff;
+		else
+			bs->crc = (bs->crc << 1) & 0x7fff;
+	}
+	bs->bits++;
+	if (b != bs->st >> 2) {
+		bs->st = b << 2;
+	} else if ((bs->st & 3) == 3) {
+		bs->bits++;
+		bs->st = !b << 2;
+	} else {
+		bs->st++;
+	}
+}
+
+/*
+ * Feed n bits of v, MSB first: the odd ones bit by bit, then a nibble
+ * per step. A nibble holds at most one stuff bit, since the stuffed bit
+ * starts a run of its own.
+ */
+static void bs_put(struct bitstream *bs, uint32_t v, int n, int crc)
+{
+	unsigned int nib, s;
+
+	while (n & 3) {
+		n--;
+		bs_bit(bs, (v >> n) & 1, crc);
+	}
+	while (n) {
+		n -= 4;
+		nib = (v >> n) & 0xf;
+		if (crc)
+			bs->crc = ((bs->crc << 4) & 0x7fff) ^
+				crc_tab[((bs->crc >> 11) ^ nib) & 0xf];
+		s = stuff_tab[bs->st][nib];
+		bs->st = s & 7;
+		bs->bits += 4 + (s >> 3);
+	}
+}
+
+/* build the nibble tables from the bitwise encoder */
+void can_load_init()
+{
+	struct bitstream bs;
+	unsigned int st, nib;
+	int i;
+
+	for (nib = 0; nib < 16; nib++) {
+		bs.crc = nib << 11;
+		for (i = 0; i < 4; i++)
+			bs_bit(&bs, 0, 1);
+		crc_tab[nib] = bs.crc;
+		for (st = 0; st < 8; st++) {
+			bs.st = st;
+			bs.bits = 0;
+			for (i = 3; i >= 0; i--)
+				bs_bit(&bs, (nib >> i) & 1, 0);
+			stuff_tab[st][nib] = bs.st | (bs.bits - 4) << 3;
+		}
+	}
+}
+
+/*
+ * Exact on-wire length of a data/remote frame, `ir` in RIR/TIR layout:
+ * SOF, arbitration, control, data, CRC with stuff bits, then CRC
+ * delimiter, ACK slot and delimiter, EOF and intermission.
+ */
+int can_frame_bits(uint32_t ir, int dlc, const uint8_t *data)
+{
+	/* after the dominant SOF: CRC still 0, a run of one 0 */
+	struct bitstream bs = {0, 0, 1};
+	uint32_t rtr = !!(ir & CAN_RI0R_RTR);
+	int i, n;
+
+	if (ir & CAN_RI0R_IDE) {
+		/* base ID, SRR, IDE; extended ID, RTR, r1, r0, DLC */
+		bs_put(&bs, (ir >> 21) << 2 | 3, 13, 1);
+		bs_put(&bs, ((ir >> 3) & 0x3ffff) << 7 | rtr << 6 | dlc, 25, 1);
+	} else {
+		/* base ID, RTR, IDE, r0, DLC */
+		bs_put(&bs, (ir >> 21) << 7 | rtr << 6 | dlc, 18, 1);
+	}
+	n = rtr ? 0 : dlc > 8 ? 8 : dlc;
+	for (i = 0; i < n; i++)
+		bs_put(&bs, data[i], 8, 1);
+	bs_put(&bs, bs.crc, 15, 0);
+
+	return bs.bits + 1 + 2 + 7 + 3;
+}
+
+/*
+ * Move bin_ts up to the bin holding `ts`, clearing the bins passed over.
+ * Several steps are only taken after the bus has been idle, and more
+ * than LOAD_BINS of them clear the whole history at once.
+ */
+static void can_load_advance(uint32_t ts)
+{
+	uint32_t n = (ts - bin_ts) >> LOAD_BIN_SHIFT;
+
+	if (n >= LOAD_BINS) {
+		memset(bins, 0, sizeof(bins));
+		bin_ts = ts & ~(LOAD_BIN_US - 1);
+		return;
+	}
+	while (n--) {
+		bin_ts += LOAD_BIN_US;
+		bins[(bin_ts >> LOAD_BIN_SHIFT) & (LOAD_BINS - 1)] = 0;
+	}
+}
+
+/* account a frame of `bits` on the wire at time ts (us), tasks and ISRs */
+void can_load_add(uint32_t ts, int bits)
+{
+	UBaseType_t mask;
+
+	mask = portSET_INTERRUPT_MASK_FROM_ISR();
+	if ((int32_t)(ts - bin_ts) >= 0) {
+		can_load_advance(ts);
+		bins[(ts >> LOAD_BIN_SHIFT) & (LOAD_BINS - 1)] += bits;
+	} else if (bin_ts - ts < (LOAD_BINS - 1) * LOAD_BIN_US) {
+		/* stamped before can_load_get() moved the bins on */
+		bins[(ts >> LOAD_BIN_SHIFT) & (LOAD_BINS - 1)] += bits;
+	}
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+}
+
+/* Snapshot and restore of the accounting, with interrupts masked */
+void can_load_save(struct can_load_state *s)
+{
+	memcpy(s->bins, bins, sizeof(bins));
+	s->bin_ts = bin_ts;
+}
+
+void can_load_restore(const struct can_load_state *s)
+{
+	memcpy(bins, s->bins, sizeof(bins));
+	bin_ts = s->bin_ts;
+}
+
+/* complete bins only, the current one is still filling */
+void can_load_get(struct can_load *l)
+{
+	unsigned int i, w, sum, cur;
+
+	taskENTER_CRITICAL();
+	can_load_advance(timebase_now());
+	cur = bin_ts >> LOAD_BIN_SHIFT;
+	sum = 0;
+	w = 0;
+	for (i = 1; i < LOAD_BINS && w < 3; i++) {
+		sum += bins[(cur - i) & (LOAD_BINS - 1)];
+		if (i == windows[w]) {
+			l->bits[w] = sum;
+			l->load[w] = (uint64_t)sum * 1000 * 1000000 /
+				((uint64_t)can_bitrate * i << LOAD_BIN_SHIFT);
+			w++;
+		}
+	}
+	taskEXIT_CRITICAL();
+}
+
+void can_load_dump()
+{
+	static const char *names[3] = {"10ms", "100ms", "1s"};
+	struct can_load l;
+	int i;
+
+	can_load_get(&l);
+	xprintf("Bitrate: %u\r\n", can_bitrate);
+	for (i = 0; i < 3; i++)
+		xprintf("Load %s: %u.%u%% (%u bits)\r\n", names[i],
+		       l.load[i] / 10, l.load[i] % 10, l.bits[i]);
+}
@@ -0,0 +1,263 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "can.h"
+#include "capture.h"
+#include "fmt.h"
+
+/* linux/can/error.h, for error events in the candump output */
+#define CAN_ERR_FLAG		0x20000000
+#define CAN_ERR_CRTL		0x00000004
+#define CAN_ERR_PROT		0x00000008
+#define CAN_ERR_ACK		0x00000020
+#define CAN_ERR_BUSOFF		0x00000040
+#define CAN_ERR_BUSERROR	0x00000080
+
+#ifdef TARGET_F407
+/* CPU only, not DMA reachable; left uninitialised by the startup code */
+static struct can_frame cap_buf[CAPTURE_FRAMES]
+	__attribute__((section(".ccmram")));
+#else
+static struct can_frame cap_buf[CAPTURE_FRAMES];
+#endif
+_Static_assert((CAPTURE_FRAMES & (CAPTURE_FRAMES - 1)) == 0,
+	       "CAPTURE_FRAMES must be a power of two");
+
+static volatile enum capture_state cap_state;
+static volatile unsigned int cap_in;	/* frames recorded, free running */
+static unsigned int cap_trig;		/* cap_in of the trigger frame */
+static int cap_trig_valid;
+static unsigned int cap_post, cap_left;
+
+/* a frame triggers if both its ID and its payload match */
+static struct {
+	int frame, err;
+	uint32_t id, id_mask;
+	uint32_t pat[2], mask[2];
+} trig;
+
+void capture_trig_id(uint32_t id, uint32_t mask)
+{
+	taskENTER_CRITICAL();
+	trig.id = id & mask;
+	trig.id_mask = mask;
+	trig.frame = 1;
+	taskEXIT_CRITICAL();
+}
+
+void capture_trig_data(const uint8_t *pat, const uint8_t *mask)
+{
+	uint32_t p[2], m[2];
+
+	memcpy(m, mask, 8);
+	memcpy(p, pat, 8);
+	taskENTER_CRITICAL();
+	trig.mask[0] = m[0];
+	trig.mask[1] = m[1];
+	trig.pat[0] = p[0] & m[0];
+	trig.pat[1] = p[1] & m[1];
+	trig.frame = 1;
+	taskEXIT_CRITICAL();
+}
+
+void capture_trig_err(int on)
+{
+	taskENTER_CRITICAL();
+	trig.err = on;
+	if (cap_state == CAPTURE_ARMED || cap_state == CAPTURE_TRIGGERED)
+		can_err_irq(on);
+	taskEXIT_CRITICAL();
+}
+
+void capture_trig_off()
+{
+	taskENTER_CRITICAL();
+	memset(&trig, 0, sizeof(trig));
+	taskEXIT_CRITICAL();
+}
+
+/*
+ * Start recording. Once triggered, `post` more frames are recorded and
+ * the buffer freezes, the rest of it holds the pre-trigger history.
+ */
+int capture_arm(unsigned int post)
+{
+	if (post >= CAPTURE_FRAMES)
+		return -1;
+	taskENTER_CRITICAL();
+	cap_in = 0;
+	cap_trig_valid = 0;
+	cap_post = post;
+	cap_state = CAPTURE_ARMED;
+	can_err_irq(trig.err);
+	taskEXIT_CRITICAL();
+	return 0;
+}
+
+/* Freeze now, without a trigger */
+void capture_stop()
+{
+	taskENTER_CRITICAL();
+	if (cap_state != CAPTURE_IDLE)
+		cap_state = CAPTURE_FROZEN;
+	can_err_irq(0);
+	taskEXIT_CRITICAL();
+}
+
+/* CAN interrupts: store `f`, then check the trigger on it */
+static void capture_put(const struct can_frame *f, int match)
+{
+	cap_buf[cap_in & (CAPTURE_FRAMES - 1)] = *f;
+	cap_in++;
+
+	if (cap_state == CAPTURE_ARMED) {
+		if (!match)
+			return;
+		cap_trig = cap_in - 1;
+		cap_trig_valid = 1;
+		cap_left = cap_post;
+		cap_state = CAPTURE_TRIGGERED;
+	} else {
+		cap_left--;
+	}
+	if (!cap_left) {
+		cap_state = CAPTURE_FROZEN;
+		can_err_irq(0);
+	}
+}
+
+void capture_frame(const struct can_frame *f)
+{
+	int match;
+
+	if (cap_state != CAPTURE_ARMED && cap_state != CAPTURE_TRIGGERED)
+		return;
+	match = trig.frame &&
+		((f->ir & CAN_ID_EXT ? CAN_FRAME_EXTID(f) : CAN_FRAME_STDID(f)) &
+		 trig.id_mask) == trig.id &&
+		(f->dw[0] & trig.mask[0]) == trig.pat[0] &&
+		(f->dw[1] & trig.mask[1]) == trig.pat[1];
+	capture_put(f, match);
+}
+
+void capture_error(uint32_t esr, uint32_t ts)
+{
+	struct can_frame f;
+
+	if (cap_state != CAPTURE_ARMED && cap_state != CAPTURE_TRIGGERED)
+		return;
+	f.ir = CAPTURE_ERR;
+	f.dtr = esr;
+	f.dw[0] = f.dw[1] = 0;
+	f.ts = ts;
+	capture_put(&f, trig.err);
+}
+
+enum capture_state capture_get_state()
+{
+	return cap_state;
+}
+
+void capture_status()
+{
+	static const char *names[] = {"idle", "armed", "triggered", "frozen"};
+	unsigned int n = cap_in;
+
+	xprintf("State: %s\r\n", names[cap_state]);
+	xprintf("Frames: %u/%u (%u seen)\r\n",
+		n < CAPTURE_FRAMES ? n : CAPTURE_FRAMES, CAPTURE_FRAMES, n);
+	xprintf("Trigger:");
+	if (trig.frame)
+		xprintf(" id %x/%x data %08x%08x/%08x%08x",
+			trig.id, trig.id_mask,
+			__builtin_bswap32(trig.pat[0]),
+			__builtin_bswap32(trig.pat[1]),
+			__builtin_bswap32(trig.mask[0]),
+			__builtin_bswap32(trig.mask[1]));
+	if (trig.err)
+		xprintf(" err");
+	if (!trig.frame && !trig.err)
+		xprintf(" none");
+	xprintf(", post %u\r\n", cap_post);
+	if (cap_trig_valid && n - cap_trig <= CAPTURE_FRAMES)
+		xprintf("Triggered at frame %u of the dump, %u us\r\n",
+			cap_trig - (n > CAPTURE_FRAMES ? n - CAPTURE_FRAMES : 0),
+			cap_buf[cap_trig & (CAPTURE_FRAMES - 1)].ts);
+}
+
+/* ESR of an error event as a SocketCAN error frame */
+static uint32_t capture_err_frame(uint32_t esr, uint8_t *d)
+{
+	/* LEC: stuff, form, ack, recessive bit, dominant bit, CRC */
+	static const uint8_t prot[8] = {0, 0x04, 0x02, 0, 0x10, 0x08, 0, 0};
+	uint32_t id = CAN_ERR_FLAG | CAN_ERR_BUSERROR;
+	int lec = (esr >> 4) & 7;
+
+	memset(d, 0, 8);
+	if (lec == 3) {
+		id |= CAN_ERR_ACK;
+	} else if (lec && lec < 7) {
+		id |= CAN_ERR_PROT;
+		d[2] = prot[lec];
+		if (lec == 6)
+			d[3] = 0x08;	/* CAN_ERR_PROT_LOC_CRC_SEQ */
+	}
+	if (esr & CAN_ESR_BOFF) {
+		id |= CAN_ERR_BUSOFF;
+	} else if (esr & (CAN_ESR_EPVF | CAN_ESR_EWGF)) {
+		id |= CAN_ERR_CRTL;
+		/* CAN_ERR_CRTL_{RX,TX}_{PASSIVE,WARNING} */
+		d[1] = esr & CAN_ESR_EPVF ? 0x30 : 0x0c;
+	}
+	d[6] = esr >> 16;	/* TEC */
+	d[7] = esr >> 24;	/* REC */
+	return id;
+}
+
+/* Print the frozen buffer as a candump log (candump -l), oldest first */
+void capture_dump()
+{
+	struct can_frame *f;
+	unsigned int i, n = cap_in;
+	char line[64];
+	uint8_t err[8];
+	const uint8_t *d;
+	uint32_t id;
+	int len, dlc, j;
+
+	if (cap_state != CAPTURE_FROZEN) {
+		xprintf("capture not frozen, `capture stop` first\r\n");
+		return;
+	}
+	for (i = n > CAPTURE_FRAMES ? n - CAPTURE_FRAMES : 0; i != n; i++) {
+		f = &cap_buf[i & (CAPTURE_FRAMES - 1)];
+		len = xsnprintf(line, sizeof(line), "(%u.%06u) can0 ",
+				f->ts / 1000000, f->ts % 1000000);
+		if (f->ir & CAPTURE_ERR) {
+			id = capture_err_frame(f->dtr, err);
+			d = err;
+			dlc = 8;
+			len += xsnprintf(line + len, sizeof(line) - len,
+					 "%08X#", id);
+		} else {
+			d = f->data;
+			dlc = CAN_FRAME_DLC(f);
+			if (f->ir & CAN_ID_EXT)
+				len += xsnprintf(line + len, sizeof(line) - len,
+						 "%08X#", CAN_FRAME_EXTID(f));
+			else
+				len += xsnprintf(line + len, sizeof(line) - len,
+						 "%03X#", CAN_FRAME_STDID(f));
+		}
+		if (f->ir & CAN_RTR_REMOTE) {
+			line[len++] = 'R';
+		} else {
+			for (j = 0; j < dlc && j < 8; j++)
+				len += xsnprintf(line + len, sizeof(line) - len,
+						 "%02X", d[j]);
+		}
+		line[len++] = '\r';
+		line[len++] = '\n';
+		xwrite(line, len);
+	}
+}
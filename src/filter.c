@@ -0,0 +1,370 @@
+#include <string.h>
+#include "filter.h"
+
+/*
+ * Bytecode: an opcode byte, field in the high nibble and comparison in
+ * the low one, followed by its operands. Tests push a bit on the
+ * evaluation stack, the logic ops combine the topmost bits.
+ */
+#define F_ID		0	/* operands: 4 byte constant(s), LE */
+#define F_DLC		1	/* operands: 1 byte constant(s) */
+#define F_B0		2	/* ..F_B0 + 7, [mask byte] 1 byte constant(s) */
+#define F_EXT		10	/* no operands */
+#define F_RTR		11
+#define F_LOGIC		15
+
+#define C_EQ		0
+#define C_NE		1
+#define C_LT		2
+#define C_GT		3
+#define C_LE		4
+#define C_GE		5
+#define C_IN		6	/* two constants, inclusive range */
+#define C_MASK		8	/* payload byte: AND with a mask first */
+
+#define L_AND		0
+#define L_OR		1
+#define L_NOT		2
+
+struct fc {
+	const char *p;
+	uint8_t *out;
+	int len, size, depth, max;
+};
+
+static int fc_expr(struct fc *c);
+
+static void fc_ws(struct fc *c)
+{
+	while (*c->p == ' ')
+		c->p++;
+}
+
+static int fc_emit(struct fc *c, uint8_t b)
+{
+	if (c->len >= c->size)
+		return -1;
+	c->out[c->len++] = b;
+	return 0;
+}
+
+static int fc_emit32(struct fc *c, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (fc_emit(c, v >> (8 * i)))
+			return -1;
+	return 0;
+}
+
+static int fc_push(struct fc *c)
+{
+	if (++c->depth > c->max)
+		c->max = c->depth;
+	return c->max > FILTER_STACK ? -1 : 0;
+}
+
+static int fc_kw(struct fc *c, const char *kw)
+{
+	int n = strlen(kw);
+
+	if (strncmp(c->p, kw, n))
+		return 0;
+	c->p += n;
+	return 1;
+}
+
+static int fc_hex(struct fc *c, uint32_t *v)
+{
+	const char *s;
+	int d;
+
+	fc_ws(c);
+	s = c->p;
+	*v = 0;
+	for (;; c->p++) {
+		if (*c->p >= '0' && *c->p <= '9')
+			d = *c->p - '0';
+		else if (*c->p >= 'a' && *c->p <= 'f')
+			d = *c->p - 'a' + 10;
+		else if (*c->p >= 'A' && *c->p <= 'F')
+			d = *c->p - 'A' + 10;
+		else
+			break;
+		if (*v >> 28)
+			return -1;
+		*v = (*v << 4) | d;
+	}
+	return c->p == s ? -1 : 0;
+}
+
+static int fc_op(struct fc *c)
+{
+	fc_ws(c);
+	if (fc_kw(c, "!="))
+		return C_NE;
+	if (fc_kw(c, "<="))
+		return C_LE;
+	if (fc_kw(c, ">="))
+		return C_GE;
+	if (fc_kw(c, "="))
+		return C_EQ;
+	if (fc_kw(c, "<"))
+		return C_LT;
+	if (fc_kw(c, ">"))
+		return C_GT;
+	return -1;
+}
+
+/* "OP HEX" or "= HEX-HEX" after a field, `wide`: 4 byte constants */
+static int fc_cmp(struct fc *c, int field, int masked, uint32_t mask,
+		  int wide, uint32_t max)
+{
+	uint32_t lo, hi;
+	int op;
+
+	op = fc_op(c);
+	if (op < 0 || fc_hex(c, &lo) || lo > max)
+		return -1;
+	if (op == C_EQ && *c->p == '-') {
+		c->p++;
+		if (fc_hex(c, &hi) || hi > max || hi < lo)
+			return -1;
+		op = C_IN;
+	}
+	if (fc_emit(c, field << 4 | op | (masked ? C_MASK : 0)))
+		return -1;
+	if (masked && fc_emit(c, mask))
+		return -1;
+	if (wide ? fc_emit32(c, lo) : fc_emit(c, lo))
+		return -1;
+	if (op == C_IN && (wide ? fc_emit32(c, hi) : fc_emit(c, hi)))
+		return -1;
+	return fc_push(c);
+}
+
+static int fc_test(struct fc *c)
+{
+	uint32_t mask = 0xff;
+	int n, masked = 0;
+
+	fc_ws(c);
+	if (fc_kw(c, "ext"))
+		return fc_emit(c, F_EXT << 4) || fc_push(c);
+	if (fc_kw(c, "rtr"))
+		return fc_emit(c, F_RTR << 4) || fc_push(c);
+	if (fc_kw(c, "id"))
+		return fc_cmp(c, F_ID, 0, 0, 1, 0x1fffffff);
+	if (fc_kw(c, "dlc"))
+		return fc_cmp(c, F_DLC, 0, 0, 0, 8);
+	if (*c->p == 'b' && c->p[1] >= '0' && c->p[1] <= '7') {
+		n = c->p[1] - '0';
+		c->p += 2;
+		if (*c->p == '/') {
+			c->p++;
+			if (fc_hex(c, &mask) || mask > 0xff)
+				return -1;
+			masked = 1;
+		}
+		return fc_cmp(c, F_B0 + n, masked, mask, 0, 0xff);
+	}
+	return -1;
+}
+
+static int fc_factor(struct fc *c)
+{
+	fc_ws(c);
+	if (*c->p == '!') {
+		c->p++;
+		return fc_factor(c) || fc_emit(c, F_LOGIC << 4 | L_NOT);
+	}
+	if (*c->p == '(') {
+		c->p++;
+		if (fc_expr(c))
+			return -1;
+		fc_ws(c);
+		if (*c->p != ')')
+			return -1;
+		c->p++;
+		return 0;
+	}
+	return fc_test(c);
+}
+
+static int fc_term(struct fc *c)
+{
+	if (fc_factor(c))
+		return -1;
+	for (;;) {
+		fc_ws(c);
+		if (*c->p != '&')
+			return 0;
+		c->p++;
+		if (fc_factor(c) || fc_emit(c, F_LOGIC << 4 | L_AND))
+			return -1;
+		c->depth--;
+	}
+}
+
+static int fc_expr(struct fc *c)
+{
+	if (fc_term(c))
+		return -1;
+	for (;;) {
+		fc_ws(c);
+		if (*c->p != '|')
+			return 0;
+		c->p++;
+		if (fc_term(c) || fc_emit(c, F_LOGIC << 4 | L_OR))
+			return -1;
+		c->depth--;
+	}
+}
+
+/* Compile `src` into `prog`, returns the bytecode length or -1 */
+int filter_compile(const char *src, uint8_t *prog, int size)
+{
+	struct fc c = {
+		.p = src,
+		.out = prog,
+		.size = size,
+	};
+
+	if (fc_expr(&c))
+		return -1;
+	fc_ws(&c);
+	return *c.p ? -1 : c.len;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Evaluate compiled bytecode on a frame, returns 1 if it holds */
+int filter_eval(const uint8_t *prog, int len, uint32_t id, int flags,
+		int dlc, const uint8_t *data)
+{
+	const uint8_t *p = prog, *end = prog + len;
+	uint32_t st = 0, v, lo, hi = 0;
+	int op, field, b;
+
+	while (p < end) {
+		op = *p & 0xf;
+		field = *p++ >> 4;
+		if (field == F_LOGIC) {
+			if (op == L_NOT) {
+				st ^= 1;
+			} else {
+				b = st & 1;
+				st >>= 1;
+				b = op == L_AND ? (st & b) : (st | b);
+				st = (st & ~1) | (b & 1);
+			}
+			continue;
+		}
+		if (field == F_EXT || field == F_RTR) {
+			st = st << 1 | !!(flags & (field == F_EXT ? FILTER_EXT :
+							FILTER_RTR));
+			continue;
+		}
+		if (field == F_ID) {
+			v = id;
+			if (p + ((op & 7) == C_IN ? 8 : 4) > end)
+				return 0;
+			lo = get32(p);
+			p += 4;
+			if ((op & 7) == C_IN) {
+				hi = get32(p);
+				p += 4;
+			}
+		} else {
+			if (field == F_DLC) {
+				v = dlc;
+			} else {
+				b = field - F_B0;
+				v = b < dlc ? data[b] : 0;
+				if (op & C_MASK)
+					v &= *p++;
+			}
+			if (p + ((op & 7) == C_IN ? 2 : 1) > end)
+				return 0;
+			lo = *p++;
+			if ((op & 7) == C_IN)
+				hi = *p++;
+		}
+		switch (op & 7) {
+		case C_EQ: b = v == lo; break;
+		case C_NE: b = v != lo; break;
+		case C_LT: b = v < lo; break;
+		case C_GT: b = v > lo; break;
+		case C_LE: b = v <= lo; break;
+		case C_GE: b = v >= lo; break;
+		default: b = v >= lo && v <= hi; break;
+		}
+		st = st << 1 | b;
+	}
+	return st & 1;
+}
+
+/* No rules, pass everything; rule slots past nrules are never read */
+void filter_init(struct filter *fl)
+{
+	fl->nrules = 0;
+	fl->dfl = FILTER_QUEUE | FILTER_CAPTURE;
+	fl->dfl_hits = 0;
+}
+
+/* Compile a rule for filter_add(), with no hits yet */
+int filter_rule_init(struct filter_rule *r, int action, const char *src)
+{
+	int len;
+
+	if (strlen(src) >= FILTER_SRC)
+		return -1;
+	len = filter_compile(src, r->prog, FILTER_PROG);
+	if (len <= 0)
+		return -1;
+	r->len = len;
+	r->action = action;
+	r->hits = 0;
+	strcpy(r->src, src);
+	return 0;
+}
+
+int filter_add(struct filter *fl, const struct filter_rule *r)
+{
+	if (fl->nrules >= FILTER_RULES)
+		return -1;
+	fl->rule[fl->nrules++] = *r;
+	return 0;
+}
+
+int filter_del(struct filter *fl, int idx)
+{
+	if (idx < 0 || idx >= fl->nrules)
+		return -1;
+	memmove(&fl->rule[idx], &fl->rule[idx + 1],
+		(fl->nrules - idx - 1) * sizeof(fl->rule[0]));
+	fl->nrules--;
+	return 0;
+}
+
+/* First matching rule's action, counting the hit */
+int filter_run(struct filter *fl, uint32_t id, int flags, int dlc,
+	       const uint8_t *data)
+{
+	struct filter_rule *r;
+	int i;
+
+	for (i = 0; i < fl->nrules; i++) {
+		r = &fl->rule[i];
+		if (filter_eval(r->prog, r->len, id, flags, dlc, data)) {
+			r->hits++;
+			return r->action;
+		}
+	}
+	fl->dfl_hits++;
+	return fl->dfl;
+}
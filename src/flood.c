@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#ifdef TARGET_F407
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_tim.h"
+#include "misc.h"
+#endif
+#ifdef TARGET_F091
+#include "stm32f0xx_rcc.h"
+#include "stm32f0xx_tim.h"
+#include "stm32f0xx_misc.h"
+#endif
+#include "can.h"
+#include "can_load.h"
+#include "timebase.h"
+#include "flood.h"
+#include "prof.h"
+#include "fmt.h"
+
+#define FLOOD_TIM		TIM3
+#define FLOOD_TIM_CLK		RCC_APB1Periph_TIM3
+#define FLOOD_IRQ		TIM3_IRQn
+
+static unsigned int ids[FLOOD_MAX_IDS] = {0x100};
+static int nids = 1;
+static unsigned char dlcs[FLOOD_MAX_DLCS] = {8};
+static int ndlcs = 1;
+static enum flood_pattern pattern = FLOOD_COUNTER;
+static unsigned char pattern_val;
+
+/*
+ * Pacing credit. Every timer tick adds credit_inc, sending a frame costs
+ * FLOOD_TICK_HZ (FPS mode) or its bit length * FLOOD_TICK_HZ (load mode).
+ */
+static volatile int32_t credit, credit_next;
+static int32_t credit_inc, credit_max;
+static volatile TaskHandle_t flood_task;
+
+/* parse "a,b,c" of numbers in base `base` into `out` */
+static int flood_parse_list(char *list, unsigned int *out, int max, int base)
+{
+	char *end;
+	int n = 0;
+
+	while (*list) {
+		if (n >= max)
+			return -1;
+		out[n++] = strtoul(list, &end, base);
+		if (end == list || (*end && *end != ','))
+			return -1;
+		list = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+int flood_set_ids(char *list)
+{
+	unsigned int v[FLOOD_MAX_IDS];
+	int i, n;
+
+	n = flood_parse_list(list, v, FLOOD_MAX_IDS, 0x10);
+	if (n <= 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		ids[i] = v[i] & 0x7ff;
+	nids = n;
+	return 0;
+}
+
+int flood_set_dlcs(char *list)
+{
+	unsigned int v[FLOOD_MAX_DLCS];
+	int i, n;
+
+	n = flood_parse_list(list, v, FLOOD_MAX_DLCS, 10);
+	if (n <= 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (v[i] > 8)
+			return -1;
+	for (i = 0; i < n; i++)
+		dlcs[i] = v[i];
+	ndlcs = n;
+	return 0;
+}
+
+void flood_set_pattern(enum flood_pattern p, unsigned char val)
+{
+	pattern = p;
+	pattern_val = val;
+}
+
+void flood_dump_config()
+{
+	static const char *names[] = {"counter", "const", "random"};
+	int i;
+
+	xprintf("IDs:");
+	for (i = 0; i < nids; i++)
+		xprintf(" %03x", ids[i]);
+	xprintf("\r\nDLCs:");
+	for (i = 0; i < ndlcs; i++)
+		xprintf(" %d", dlcs[i]);
+	xprintf("\r\nData: %s", names[pattern]);
+	if (pattern == FLOOD_CONST)
+		xprintf(" %02x", pattern_val);
+	xprintf("\r\n");
+}
+
+static void flood_payload(unsigned char *data, uint32_t n)
+{
+	static uint32_t rnd = 0x12345678;
+	int i;
+
+	switch (pattern) {
+	case FLOOD_COUNTER:
+		memset(data, 0, 8);
+		memcpy(data, &n, sizeof(n));
+		break;
+	case FLOOD_CONST:
+		memset(data, pattern_val, 8);
+		break;
+	case FLOOD_RANDOM:
+		for (i = 0; i < 8; i += 4) {
+			/* xorshift32 */
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 17;
+			rnd ^= rnd << 5;
+			memcpy(data + i, &rnd, 4);
+		}
+		break;
+	}
+}
+
+static void flood_timer_start()
+{
+	TIM_TimeBaseInitTypeDef tim;
+	NVIC_InitTypeDef nvic;
+
+	RCC_APB1PeriphClockCmd(FLOOD_TIM_CLK, ENABLE);
+	TIM_TimeBaseStructInit(&tim);
+	tim.TIM_Prescaler = TIMEBASE_CLK_HZ / 1000000 - 1;
+	tim.TIM_Period = 1000000 / FLOOD_TICK_HZ - 1;
+	TIM_TimeBaseInit(FLOOD_TIM, &tim);
+	TIM_ClearITPendingBit(FLOOD_TIM, TIM_IT_Update);
+	TIM_ITConfig(FLOOD_TIM, TIM_IT_Update, ENABLE);
+
+	nvic.NVIC_IRQChannel = FLOOD_IRQ;
+#ifdef TARGET_F407
+	nvic.NVIC_IRQChannelPreemptionPriority = configMAX_SYSCALL_INTERRUPT_PRIORITY >> 4;
+	nvic.NVIC_IRQChannelSubPriority = 0x0;
+#endif
+#ifdef TARGET_F091
+	nvic.NVIC_IRQChannelPriority = configMAX_SYSCALL_INTERRUPT_PRIORITY >> 6;
+#endif
+	nvic.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&nvic);
+
+	TIM_Cmd(FLOOD_TIM, ENABLE);
+}
+
+static void flood_timer_stop()
+{
+	TIM_Cmd(FLOOD_TIM, DISABLE);
+	TIM_ITConfig(FLOOD_TIM, TIM_IT_Update, DISABLE);
+	NVIC_DisableIRQ(FLOOD_IRQ);
+}
+
+void TIM3_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	int32_t c;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_FLOOD);
+
+	FLOOD_TIM->SR = ~TIM_SR_UIF;
+	c = credit + credit_inc;
+	/* don't bank more than a burst while the bus is saturated */
+	if (c > credit_max)
+		c = credit_max;
+	credit = c;
+	if (c >= credit_next && flood_task)
+		vTaskNotifyGiveFromISR(flood_task, &woken);
+	prof_isr_exit(PROF_IRQ_FLOOD, t0);
+	portEND_SWITCHING_ISR(woken);
+}
+
+/*
+ * Generate traffic for `ms` milliseconds. `rate` is frames per second
+ * in FLOOD_FPS mode and bus load in permille in FLOOD_LOAD mode.
+ */
+void flood_run(enum flood_mode mode, unsigned int rate, unsigned int ms)
+{
+	unsigned char data[8];
+	uint32_t n = 0, tim, el;
+	uint64_t bits = 0;
+	int len, fbits, iid = 0, idlc = 0;
+	int32_t cost;
+	unsigned int id;
+
+	credit = 0;
+	credit_next = 0x7fffffff;
+	if (mode == FLOOD_FPS) {
+		credit_inc = rate;
+		credit_max = 8 * FLOOD_TICK_HZ;
+	} else if (mode == FLOOD_LOAD) {
+		credit_inc = (uint64_t)rate * can_bitrate / 1000;
+		credit_max = 8 * 135 * FLOOD_TICK_HZ;
+	}
+	flood_task = xTaskGetCurrentTaskHandle();
+	if (mode != FLOOD_MAX)
+		flood_timer_start();
+
+	tim = timebase_now();
+	while ((el = timebase_now() - tim) < ms * 1000) {
+		id = ids[iid];
+		len = dlcs[idlc];
+		flood_payload(data, n);
+		fbits = can_frame_bits(id << 21, len, data);
+
+		if (mode == FLOOD_MAX) {
+			if (can_xmit_wait(id, data, len, 1, CAN_TX_NOTAG))
+				continue;
+		} else {
+			cost = mode == FLOOD_FPS ? FLOOD_TICK_HZ :
+				fbits * FLOOD_TICK_HZ;
+			credit_next = cost;
+			if (credit < cost) {
+				ulTaskNotifyTake(pdTRUE, 1);
+				continue;
+			}
+			/* the timer keeps quiet while we wait for TX space */
+			credit_next = 0x7fffffff;
+			if (can_xmit_wait(id, data, len, 1, CAN_TX_NOTAG))
+				continue;
+			taskENTER_CRITICAL();
+			credit -= cost;
+			taskEXIT_CRITICAL();
+		}
+		bits += fbits;
+		n++;
+		if (++iid == nids)
+			iid = 0;
+		if (++idlc == ndlcs)
+			idlc = 0;
+	}
+
+	if (mode != FLOOD_MAX)
+		flood_timer_stop();
+	flood_task = NULL;
+
+	if (!el)
+		el = 1;
+	if (mode == FLOOD_FPS)
+		xprintf("Requested: %u fps\r\n", rate);
+	else if (mode == FLOOD_LOAD)
+		xprintf("Requested: %u.%u%%\r\n", rate / 10, rate % 10);
+	else
+		xprintf("Requested: max\r\n");
+	xprintf("Sent: %u frames in %u ms\r\n", n, el / 1000);
+	xprintf("Achieved: %u fps, %u.%u%%\r\n",
+	       (uint32_t)((uint64_t)n * 1000000 / el),
+	       (uint32_t)(bits * 1000000 / el * 1000 / can_bitrate) / 10,
+	       (uint32_t)(bits * 1000000 / el * 1000 / can_bitrate) % 10);
+}
@@ -0,0 +1,258 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include "fmt.h"
+
+/* newlib_stubs.c */
+int _write(int file, char *ptr, int len);
+int _read(int file, char *ptr, int len);
+
+static const char hexdig[] = "0123456789abcdef";
+
+#define POW10_N	10
+static const uint32_t dec_pow[POW10_N] = {
+	1000000000, 100000000, 10000000, 1000000, 100000,
+	10000, 1000, 100, 10, 1,
+};
+
+struct fmt_out {
+	char *buf;
+	unsigned int size, pos;
+	int fd;		/* < 0: string, truncate when full */
+	int n;		/* characters produced */
+};
+
+static void out_flush(struct fmt_out *o)
+{
+	if (o->fd >= 0 && o->pos) {
+		_write(o->fd, o->buf, o->pos);
+		o->pos = 0;
+	}
+}
+
+static void out_put(struct fmt_out *o, char c)
+{
+	o->n++;
+	if (o->pos + 1 >= o->size) {
+		if (o->fd < 0)
+			return;
+		out_flush(o);
+	}
+	o->buf[o->pos++] = c;
+}
+
+static void out_pad(struct fmt_out *o, char c, int n)
+{
+	while (n-- > 0)
+		out_put(o, c);
+}
+
+int fmt_hex(char *buf, uint32_t v, int digits)
+{
+	int i;
+
+	if (digits <= 0) {
+		digits = 1;
+		while (digits < 8 && (v >> (4 * digits)))
+			digits++;
+	}
+	for (i = digits - 1; i >= 0; i--) {
+		buf[i] = hexdig[v & 0xf];
+		v >>= 4;
+	}
+	return digits;
+}
+
+int fmt_udec(char *buf, uint32_t v)
+{
+	int i, n = 0;
+	char d;
+
+	for (i = 0; i < POW10_N - 1; i++)
+		if (v >= dec_pow[i])
+			break;
+	for (; i < POW10_N; i++) {
+		d = '0';
+		while (v >= dec_pow[i]) {
+			v -= dec_pow[i];
+			d++;
+		}
+		buf[n++] = d;
+	}
+	return n;
+}
+
+static void fmt_core(struct fmt_out *o, const char *fmt, va_list ap)
+{
+	char num[12];
+	const char *s;
+	int left, width, len, neg;
+	char pad, c;
+	uint32_t v;
+
+	while ((c = *fmt++)) {
+		if (c != '%') {
+			out_put(o, c);
+			continue;
+		}
+
+		left = 0;
+		pad = ' ';
+		for (;; fmt++) {
+			if (*fmt == '-')
+				left = 1;
+			else if (*fmt == '0')
+				pad = '0';
+			else
+				break;
+		}
+		width = 0;
+		while (*fmt >= '0' && *fmt <= '9')
+			width = width * 10 + *fmt++ - '0';
+		while (*fmt == 'l' || *fmt == 'h')
+			fmt++;
+
+		neg = 0;
+		s = num;
+		switch ((c = *fmt++)) {
+		case 'd':
+		case 'i':
+			v = va_arg(ap, int);
+			if ((int32_t)v < 0) {
+				neg = 1;
+				v = -v;
+			}
+			len = fmt_udec(num, v);
+			break;
+		case 'u':
+			len = fmt_udec(num, va_arg(ap, unsigned int));
+			break;
+		case 'p':
+			num[0] = '0';
+			num[1] = 'x';
+			len = 2 + fmt_hex(num + 2,
+					  (uint32_t)(uintptr_t)va_arg(ap, void *),
+					  8);
+			break;
+		case 'x':
+		case 'X':
+			len = fmt_hex(num, va_arg(ap, unsigned int), 0);
+			if (c == 'X') {
+				int i;
+
+				for (i = 0; i < len; i++)
+					if (num[i] >= 'a')
+						num[i] -= 'a' - 'A';
+			}
+			break;
+		case 'c':
+			num[0] = va_arg(ap, int);
+			len = 1;
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			for (len = 0; s[len]; len++)
+				;
+			pad = ' ';
+			break;
+		case '\0':
+			fmt--;
+			/* fall through */
+		case '%':
+			out_put(o, '%');
+			continue;
+		default:
+			out_put(o, '%');
+			out_put(o, c);
+			continue;
+		}
+
+		width -= len + neg;
+		if (!left && pad == ' ')
+			out_pad(o, ' ', width);
+		if (neg)
+			out_put(o, '-');
+		if (!left && pad == '0')
+			out_pad(o, '0', width);
+		while (len--)
+			out_put(o, *s++);
+		if (left)
+			out_pad(o, ' ', width);
+	}
+}
+
+int xvsnprintf(char *buf, unsigned int size, const char *fmt, va_list ap)
+{
+	struct fmt_out o = {
+		.buf = buf,
+		.size = size,
+		.fd = -1,
+	};
+
+	fmt_core(&o, fmt, ap);
+	if (size)
+		buf[o.pos] = '\0';
+	return o.n;
+}
+
+int xsnprintf(char *buf, unsigned int size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = xvsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+int xprintf(const char *fmt, ...)
+{
+	char buf[XPRINTF_BUF];
+	struct fmt_out o = {
+		.buf = buf,
+		.size = sizeof(buf) + 1,	/* no NUL needed */
+		.fd = 1,
+	};
+	va_list ap;
+
+	va_start(ap, fmt);
+	fmt_core(&o, fmt, ap);
+	va_end(ap);
+	out_flush(&o);
+	return o.n;
+}
+
+int xwrite(const char *buf, int len)
+{
+	return _write(1, (char *)buf, len);
+}
+
+int xputs(const char *s)
+{
+	int n;
+
+	for (n = 0; s[n]; n++)
+		;
+	return xwrite(s, n);
+}
+
+int xputc(int c)
+{
+	char ch = c;
+
+	_write(1, &ch, 1);
+	return (unsigned char)c;
+}
+
+int xgetc(void)
+{
+	char c;
+
+	if (_read(0, &c, 1) != 1)
+		return -1;
+	return (unsigned char)c;
+}
@@ -0,0 +1,183 @@
+#include <string.h>
+#include "gs_usb.h"
+
+/* bxCAN TIR/RIR bits, see struct can_frame */
+#define IR_IDE	0x4
+#define IR_RTR	0x2
+
+/*
+ * Device-to-host control request: fill `buf` (wLength bytes available)
+ * and return the reply length, -1 to stall. `wvalue` is the channel of
+ * per-channel requests; the host sends other values with the device
+ * wide ones (HOST_FORMAT, DEVICE_CONFIG), which ignore it.
+ */
+int gs_ctrl_in(struct gs_can *d, uint8_t req, uint16_t wvalue,
+	       void *buf, int len)
+{
+	struct gs_device_config *cfg;
+	uint32_t ts;
+
+	if (req != GS_USB_BREQ_DEVICE_CONFIG && wvalue != 0)	/* channel */
+		return -1;
+	switch (req) {
+	case GS_USB_BREQ_DEVICE_CONFIG:
+		if (len < (int)sizeof(*cfg))
+			return -1;
+		cfg = buf;
+		memset(cfg, 0, sizeof(*cfg));
+		cfg->icount = 0;
+		cfg->sw_version = d->sw_version;
+		cfg->hw_version = 1;
+		return sizeof(*cfg);
+	case GS_USB_BREQ_BT_CONST:
+		if (len < (int)sizeof(*d->bt_const))
+			return -1;
+		memcpy(buf, d->bt_const, sizeof(*d->bt_const));
+		return sizeof(*d->bt_const);
+	case GS_USB_BREQ_TIMESTAMP:
+		if (len < (int)sizeof(ts))
+			return -1;
+		ts = d->ops->timestamp();
+		memcpy(buf, &ts, sizeof(ts));
+		return sizeof(ts);
+	}
+	return -1;
+}
+
+/*
+ * Validate a host-to-device request and its data stage against the
+ * protocol and bt_const alone, 0 or -1 to stall. It doesn't touch the
+ * device, the USB interrupt calls it before queueing the request.
+ */
+int gs_ctrl_check(const struct gs_can *d, uint8_t req, uint16_t wvalue,
+		  const void *buf, int len)
+{
+	const struct gs_device_bt_const *c = d->bt_const;
+	struct gs_host_config hc;
+	struct gs_device_bittiming bt;
+	struct gs_device_mode m;
+	uint32_t tseg1;
+
+	if (req != GS_USB_BREQ_HOST_FORMAT && wvalue != 0)	/* channel */
+		return -1;
+	switch (req) {
+	case GS_USB_BREQ_HOST_FORMAT:
+		if (len < (int)sizeof(hc))
+			return -1;
+		memcpy(&hc, buf, sizeof(hc));
+		return hc.byte_order == GS_HOST_FORMAT_LE ? 0 : -1;
+	case GS_USB_BREQ_BITTIMING:
+		if (len < (int)sizeof(bt))
+			return -1;
+		memcpy(&bt, buf, sizeof(bt));
+		tseg1 = bt.prop_seg + bt.phase_seg1;
+		if (tseg1 < c->tseg1_min || tseg1 > c->tseg1_max ||
+		    bt.phase_seg2 < c->tseg2_min ||
+		    bt.phase_seg2 > c->tseg2_max ||
+		    bt.sjw < 1 || bt.sjw > c->sjw_max ||
+		    bt.brp < c->brp_min || bt.brp > c->brp_max)
+			return -1;
+		return 0;
+	case GS_USB_BREQ_MODE:
+		if (len < (int)sizeof(m))
+			return -1;
+		memcpy(&m, buf, sizeof(m));
+		if (m.mode == GS_CAN_MODE_RESET)
+			return 0;
+		if (m.mode != GS_CAN_MODE_START || (m.flags & ~c->feature))
+			return -1;
+		return 0;
+	case GS_USB_BREQ_IDENTIFY:
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Carry out a host-to-device request, 0 or -1 if the device refuses it
+ * in its current state (BITTIMING or START while started).
+ */
+int gs_ctrl_out(struct gs_can *d, uint8_t req, uint16_t wvalue,
+		const void *buf, int len)
+{
+	struct gs_device_bittiming bt;
+	struct gs_device_mode m;
+
+	if (gs_ctrl_check(d, req, wvalue, buf, len))
+		return -1;
+	switch (req) {
+	case GS_USB_BREQ_BITTIMING:
+		if (d->started)
+			return -1;
+		memcpy(&bt, buf, sizeof(bt));
+		return d->ops->bittiming(bt.brp, bt.prop_seg + bt.phase_seg1,
+					 bt.phase_seg2, bt.sjw);
+	case GS_USB_BREQ_MODE:
+		memcpy(&m, buf, sizeof(m));
+		if (m.mode == GS_CAN_MODE_RESET) {
+			d->ops->reset();
+			d->started = 0;
+			return 0;
+		}
+		if (d->started || d->ops->start(m.flags))
+			return -1;
+		d->flags = m.flags;
+		d->started = 1;
+		return 0;
+	}
+	return 0;
+}
+
+/* Bytes per host frame on the bulk endpoints in the current mode */
+int gs_frame_size(const struct gs_can *d)
+{
+	return d->flags & GS_CAN_FEATURE_HW_TIMESTAMP ?
+		GS_HOST_FRAME_TS_SIZE : GS_HOST_FRAME_SIZE;
+}
+
+/*
+ * Build a host frame from a bus frame, `ir` laid out as bxCAN RIR.
+ * Use GS_ECHO_ID_RX for received frames. Returns the frame size.
+ */
+int gs_frame_encode(const struct gs_can *d, struct gs_host_frame *hf,
+		    uint32_t echo_id, uint32_t ir, int dlc,
+		    const uint8_t *data, uint32_t ts)
+{
+	memset(hf, 0, sizeof(*hf));
+	hf->echo_id = echo_id;
+	if (ir & IR_IDE)
+		hf->can_id = ((ir >> 3) & 0x1fffffff) | GS_CAN_EFF_FLAG;
+	else
+		hf->can_id = ir >> 21;
+	if (ir & IR_RTR)
+		hf->can_id |= GS_CAN_RTR_FLAG;
+	if (dlc > 8)
+		dlc = 8;
+	hf->can_dlc = dlc;
+	if (!(ir & IR_RTR))
+		memcpy(hf->data, data, dlc);
+	hf->timestamp_us = ts;
+	return gs_frame_size(d);
+}
+
+/*
+ * Validate a frame from the host and convert its identifier to the
+ * bxCAN TIR layout. Returns the DLC, -1 if the frame is malformed.
+ */
+int gs_frame_decode(const struct gs_host_frame *hf, int len, uint32_t *ir)
+{
+	uint32_t id = hf->can_id;
+
+	if (len < GS_HOST_FRAME_SIZE || hf->channel != 0 ||
+	    hf->can_dlc > 8 || (id & GS_CAN_ERR_FLAG))
+		return -1;
+	if (id & GS_CAN_EFF_FLAG)
+		*ir = ((id & 0x1fffffff) << 3) | IR_IDE;
+	else if (id & 0x1ffff800)
+		return -1;
+	else
+		*ir = (id & 0x7ff) << 21;
+	if (id & GS_CAN_RTR_FLAG)
+		*ir |= IR_RTR;
+	return hf->can_dlc;
+}
@@ -0,0 +1,79 @@
+#include <string.h>
+#include "hist.h"
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = 0xffffffff;
+}
+
+static inline int hist_index(uint32_t v)
+{
+	int k;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+	k = 31 - __builtin_clz(v) - HIST_SUB_BITS + 1;
+	return (k + 1) * HIST_HALF + (v >> k) - HIST_HALF;
+}
+
+/* smallest value falling into bucket idx */
+uint32_t hist_bucket_low(int idx)
+{
+	int k;
+
+	if (idx < (1 << HIST_SUB_BITS))
+		return idx;
+	k = idx / HIST_HALF - 1;
+	return (uint32_t)(idx % HIST_HALF + HIST_HALF) << k;
+}
+
+void hist_add(struct hist *h, uint32_t v)
+{
+	h->bucket[hist_index(v)]++;
+	if (h->count)
+		h->jsum += v > h->last ? v - h->last : h->last - v;
+	h->count++;
+	h->sum += v;
+	h->last = v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* value below which num/den of the samples fall, to bucket precision */
+uint32_t hist_quantile(struct hist *h, uint32_t num, uint32_t den)
+{
+	uint64_t rank, seen = 0;
+	uint32_t v;
+	int i;
+
+	if (!h->count)
+		return 0;
+	rank = ((uint64_t)h->count * num + den - 1) / den;
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+	v = hist_bucket_low(i);
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+	return v;
+}
+
+uint32_t hist_mean(struct hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+/* mean difference between consecutive samples */
+uint32_t hist_jitter(struct hist *h)
+{
+	return h->count > 1 ? h->jsum / (h->count - 1) : 0;
+}
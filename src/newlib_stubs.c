@@ -11,21 +11,27 @@
 #include <sys/stat.h>
 #include <sys/times.h>
 
+#include "FreeRTOS.h"
+#include "task.h"
+
 #ifdef TARGET_F407
 #include "stm32f4xx.h"
 #include "usbd_cdc_vcp.h"
 
-volatile uint8_t stdin_buffer[STDIN_BUFFER_SIZE];
-volatile uint16_t stdin_buffer_in=0;
-volatile uint16_t stdin_buffer_len=0;
-volatile uint16_t stdin_buffer_out=0;
+/* drop output once the host has not read anything for this many ticks */
+#define VCP_TX_TIMEOUT	100
+
 #endif
 
 #ifdef TARGET_F091
 #include "stm32f0xx.h"
-#include "stm32f0xx_usart.h"
+#include "usart_dma.h"
 #endif
 
+struct stdin_ring stdin_ring;
+/* task blocked in _read() */
+static volatile TaskHandle_t stdin_task;
+
 #undef errno
 extern int errno;
 
@@ -169,33 +175,59 @@ char * stack = (char*) __get_MSP();
  */
 
 
-int _read(int file, char *ptr, int len)
+/* Input arrived: wake the reader, from the USB or USART DMA interrupts */
+void stdin_wakeup_from_isr(BaseType_t *woken)
 {
-	int n = len;
+	if (stdin_task)
+		vTaskNotifyGiveFromISR(stdin_task, woken);
+}
 
-	switch (file) {
-	case STDIN_FILENO:
-		while (len--) {
+/*
+ * Read `len` console bytes, giving up once nothing arrived for `timeout`
+ * ticks. Returns the number of bytes read.
+ */
+int stdin_read(char *ptr, int len, TickType_t timeout)
+{
+	int n = 0;
+
+	while (n < len) {
+		/* sleep until the RX interrupt has queued something */
+		stdin_task = xTaskGetCurrentTaskHandle();
+		if (ring_empty(&stdin_ring)) {
+			if (!ulTaskNotifyTake(pdTRUE, timeout) &&
+			    ring_empty(&stdin_ring))
+				break;
+			continue;
+		}
+		ptr[n++] = *ring_tail(&stdin_ring);
+		ring_pop(&stdin_ring);
 #ifdef TARGET_F407
-			while (!stdin_buffer_len)
-				;
-			if (stdin_buffer_out >= STDIN_BUFFER_SIZE)
-				stdin_buffer_out = 0;
-			*ptr++ = stdin_buffer[stdin_buffer_out++];
-			stdin_buffer_len--;
+		/* the OUT endpoint NAKs until there is room again */
+		VCP_RxResume();
 #endif
-#ifdef TARGET_F091
-			while (!USART_GetFlagStatus(USART2, USART_FLAG_RXNE))
-				;
-			*ptr++ = (int)USART_ReceiveData(USART2);
+	}
+	return n;
+}
+
+/* Discard the oldest `n` console bytes, `n` no more than are queued */
+void stdin_drop(int n)
+{
+	while (n--)
+		ring_pop(&stdin_ring);
+#ifdef TARGET_F407
+	VCP_RxResume();
 #endif
-		}
-		break;
+}
+
+int _read(int file, char *ptr, int len)
+{
+	switch (file) {
+	case STDIN_FILENO:
+		return stdin_read(ptr, len, portMAX_DELAY);
 	default:
 		errno = EBADF;
 		return -1;
 	}
-	return n;
 }
 
 /*
@@ -236,6 +268,91 @@ int _read(int file, char *ptr, int len)
     return -1;
 }*/
 
+/*
+ * Called from an interrupt handler or with interrupts masked: no kernel
+ * calls, they would unmask interrupts on their way out, and no waiting.
+ */
+static inline int write_atomic(void)
+{
+#ifdef TARGET_F407
+	/* taskDISABLE_INTERRUPTS() raises BASEPRI */
+	return __get_IPSR() || __get_PRIMASK() || __get_BASEPRI();
+#endif
+#ifdef TARGET_F091
+	return __get_IPSR() || __get_PRIMASK();
+#endif
+}
+
+#ifdef TARGET_F407
+/*
+ * Block while the IN buffer is full. If the host stops reading, the
+ * rest is dropped and later writes don't wait until it drains again.
+ * With interrupts masked only what fits is queued.
+ */
+static void vcp_write(const char *ptr, int len)
+{
+	static int stalled;
+	int atomic = write_atomic();
+	int running = !atomic &&
+		xTaskGetSchedulerState() == taskSCHEDULER_RUNNING;
+	TickType_t t = xTaskGetTickCount();
+	uint32_t n;
+
+	while (len) {
+		if (running)
+			vTaskSuspendAll();
+		n = VCP_Write((const uint8_t *)ptr, len);
+		if (running)
+			xTaskResumeAll();
+		ptr += n;
+		len -= n;
+		if (n) {
+			stalled = 0;
+			t = xTaskGetTickCount();
+		}
+		if (!len)
+			break;
+		if (!running || stalled ||
+		    xTaskGetTickCount() - t >= VCP_TX_TIMEOUT) {
+			/* masked, the host is not necessarily stuck */
+			if (!atomic)
+				stalled = 1;
+			VCP_tx_dropped += len;
+			break;
+		}
+		vTaskDelay(1);
+	}
+	VCP_Flush();
+}
+#endif
+
+#ifdef TARGET_F091
+/*
+ * Block while the DMA TX buffer is full, the USART always drains it.
+ * With interrupts masked only what fits is queued, the rest is lost.
+ */
+static void usart_write(const char *ptr, int len)
+{
+	int running = !write_atomic() &&
+		xTaskGetSchedulerState() == taskSCHEDULER_RUNNING;
+	int n;
+
+	while (len) {
+		if (running)
+			vTaskSuspendAll();
+		n = usart_dma_write(ptr, len);
+		if (running)
+			xTaskResumeAll();
+		ptr += n;
+		len -= n;
+		/* no TX interrupts before the scheduler starts or when masked */
+		if (!len || !running)
+			break;
+		usart_dma_wait();
+	}
+}
+#endif
+
 /*
  write
  Write a character to a file. `libc' subroutines will use this system routine for output to all files, including stdout
@@ -248,16 +365,12 @@ int _write(int file, char *ptr, int len)
 	switch (file) {
 	case STDOUT_FILENO: /*stdout*/
 	case STDERR_FILENO: /* stderr */
-		while (len--) {
 #ifdef TARGET_F407
-			VCP_DataTx(ptr++);
+		vcp_write(ptr, len);
 #endif
 #ifdef TARGET_F091
-			while (!USART_GetFlagStatus(USART2, USART_FLAG_TXE))
-				;
-			USART_SendData(USART2, *ptr++);
+		usart_write(ptr, len);
 #endif
-		}
 		break;
 	default:
 		errno = EBADF;
@@ -0,0 +1,156 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "prof.h"
+#include "fmt.h"
+
+struct prof_isr prof_isr;
+
+const char *const prof_irq_names[PROF_IRQS] = {
+#ifdef TARGET_F407
+	[PROF_IRQ_CAN_RX] = "can_rx",
+	[PROF_IRQ_CAN_TX] = "can_tx",
+	[PROF_IRQ_CAN_SCE] = "can_sce",
+	[PROF_IRQ_USB] = "usb",
+#endif
+#ifdef TARGET_F091
+	[PROF_IRQ_CAN] = "can",
+	[PROF_IRQ_DMA] = "con_dma",
+	[PROF_IRQ_USART] = "con_usart",
+#endif
+	[PROF_IRQ_TICK] = "systick",
+	[PROF_IRQ_TIMEBASE] = "timebase",
+	[PROF_IRQ_FLOOD] = "flood",
+};
+
+/* counters at the previous `top` sample */
+static struct {
+	TaskHandle_t h;
+	uint32_t run;
+} top_prev[PROF_TASKS];
+static int top_nprev;
+static uint32_t top_total, top_isr;
+
+/* portCONFIGURE_TIMER_FOR_RUN_TIME_STATS, from vTaskStartScheduler() */
+void prof_init()
+{
+#ifdef TARGET_F407
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	PROF_DWT_CYCCNT = 0;
+	PROF_DWT_CTRL |= PROF_DWT_CYCCNTENA;
+#endif
+	/* F091: the timebase is started by main() */
+}
+
+/* portGET_RUN_TIME_COUNTER_VALUE, on every context switch */
+uint32_t prof_counter()
+{
+	return prof_now();
+}
+
+static TaskStatus_t top_ts[PROF_TASKS];
+
+static void top_save(int n, uint32_t total, uint32_t isr)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		top_prev[i].h = top_ts[i].xHandle;
+		top_prev[i].run = top_ts[i].ulRunTimeCounter;
+	}
+	top_nprev = n;
+	top_total = total;
+	top_isr = isr;
+}
+
+void prof_top_reset()
+{
+	uint32_t total, isr = prof_isr.time;
+	int n;
+
+	n = uxTaskGetSystemState(top_ts, PROF_TASKS, &total);
+	top_save(n, total, isr);
+}
+
+/* tenths of a percent of `dt` */
+static unsigned int permille(uint32_t t, uint32_t dt)
+{
+	dt /= 1000;
+	return dt ? t / dt : 0;
+}
+
+/*
+ * CPU use per task since the previous call. Interrupts are charged to
+ * the task they preempted, so task figures include their share of the
+ * interrupt line.
+ */
+void prof_top()
+{
+	static const char state[] = "XRBSD";	/* eTaskState */
+	TaskStatus_t *ts = top_ts;
+	uint32_t total, isr = prof_isr.time, dt, run;
+	unsigned int pm;
+	int i, j, n;
+
+	n = uxTaskGetSystemState(ts, PROF_TASKS, &total);
+	dt = total - top_total;
+	xprintf("%u ms\r\n", dt / (PROF_HZ / 1000));
+	xprintf("TASK             PRI S  CPU%%  STACK\r\n");
+	for (i = 0; i < n; i++) {
+		run = ts[i].ulRunTimeCounter;
+		for (j = 0; j < top_nprev; j++)
+			if (top_prev[j].h == ts[i].xHandle) {
+				run -= top_prev[j].run;
+				break;
+			}
+		pm = permille(run, dt);
+		xprintf("%-16s %3u %c %3u.%u %6u\r\n", ts[i].pcTaskName,
+			(unsigned int)ts[i].uxCurrentPriority,
+			state[ts[i].eCurrentState], pm / 10, pm % 10,
+			(unsigned int)ts[i].usStackHighWaterMark);
+	}
+	pm = permille(isr - top_isr, dt);
+	xprintf("%-16s       %3u.%u\r\n", "(interrupts)", pm / 10, pm % 10);
+	top_save(n, total, isr);
+}
+
+void prof_isr_reset()
+{
+	taskENTER_CRITICAL();
+	memset(prof_isr.irq, 0, sizeof(prof_isr.irq));
+	taskEXIT_CRITICAL();
+}
+
+/* Per handler duration statistics, in prof_now() units */
+void prof_isr_dump()
+{
+	static struct prof_irq_stat st[PROF_IRQS];
+	char label[8];
+	int i, j;
+
+	taskENTER_CRITICAL();
+	memcpy(st, prof_isr.irq, sizeof(st));
+	taskEXIT_CRITICAL();
+
+	xprintf("Durations in %s\r\n", PROF_HZ == 1000000 ? "us" : "CPU cycles");
+	xprintf("IRQ               COUNT     NEST    MIN    AVG    MAX\r\n");
+	for (i = 0; i < PROF_IRQS; i++)
+		xprintf("%-10s %12u %8u %6u %6u %6u\r\n", prof_irq_names[i],
+			st[i].count, st[i].nest,
+			st[i].min, st[i].count ?
+			(unsigned int)(st[i].total / st[i].count) : 0,
+			st[i].max);
+	xprintf("%-10s", "HIST");
+	for (j = 0; j < PROF_HIST; j++) {
+		xsnprintf(label, sizeof(label), j < PROF_HIST - 1 ? "<%u" : ">=%u",
+			  1 << (PROF_HIST_SHIFT + (j < PROF_HIST - 1 ? j : j - 1)));
+		xprintf(" %7s", label);
+	}
+	xprintf("\r\n");
+	for (i = 0; i < PROF_IRQS; i++) {
+		xprintf("%-10s", prof_irq_names[i]);
+		for (j = 0; j < PROF_HIST; j++)
+			xprintf(" %7u", st[i].hist[j]);
+		xprintf("\r\n");
+	}
+}
@@ -0,0 +1,279 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "can.h"
+#include "can_load.h"
+#include "timebase.h"
+#include "hist.h"
+#include "newlib_stubs.h"
+#include "replay.h"
+#include "fmt.h"
+
+/*
+ * Trace replay. The next frame is loaded into a free TX mailbox ahead of
+ * time and a TIM2 compare at its due time only sets TXRQ, so the trigger
+ * latency is the interrupt entry. Completions free mailboxes for staging
+ * through the can_tx_claim() hook. The alarm and the CAN interrupts run
+ * at the same priority and never preempt each other.
+ */
+
+static struct replay_rec recs[REPLAY_FRAMES];
+static unsigned int nrecs;
+static unsigned int dur_bitrate;	/* of recs[].dur */
+
+static volatile int running;
+static unsigned int next;		/* next record to stage */
+static int staged_mb = -1;
+static uint32_t staged_due;
+static uint32_t t0, scale;		/* schedule start, us; 16.16 time scale */
+static unsigned int speed_pct;
+static uint8_t mb_active;		/* mailboxes carrying replayed frames */
+static uint32_t mb_due[CAN_NUM_MB];
+static unsigned int mb_rec[CAN_NUM_MB];
+
+/* timing error statistics of the last run */
+static struct hist bus_err;		/* estimated SOF - schedule, us */
+static uint32_t trig_min, trig_max, trig_n;
+static uint64_t trig_sum;		/* TXRQ - schedule, us */
+static unsigned int late, failed;
+static uint32_t run_us;
+
+static void replay_stage(void);
+
+/* CRC-32 (IEEE, as zlib's crc32()) */
+static uint32_t replay_crc32(const uint8_t *p, unsigned int len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/*
+ * Discard what is left of an upload that timed out, up to `len` bytes,
+ * so that late binary does not end up parsed as commands.
+ */
+static void replay_flush(unsigned int len)
+{
+	char buf[32];
+	int n;
+
+	while (len) {
+		n = stdin_read(buf, len < sizeof(buf) ? len : sizeof(buf),
+			       REPLAY_LOAD_TIMEOUT);
+		if (!n)
+			break;
+		len -= n;
+	}
+}
+
+/* on-wire time of every record, so the TX interrupt only subtracts */
+static void replay_durations(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrecs; i++)
+		recs[i].dur = (uint32_t)can_frame_bits(recs[i].ir, recs[i].dlc,
+						       recs[i].data) *
+			1000000 / can_bitrate;
+	dur_bitrate = can_bitrate;
+}
+
+/*
+ * Receive `n` records of raw binary from the console, checked against
+ * `crc` and for sane contents. The upload goes straight over the loaded
+ * trace: if it fails, no trace is left loaded.
+ */
+int replay_load(unsigned int n, uint32_t crc)
+{
+	unsigned int i, got, len = n * sizeof(recs[0]);
+
+	if (running || n > REPLAY_FRAMES)
+		return -1;
+	nrecs = 0;
+	got = stdin_read((char *)recs, len, REPLAY_LOAD_TIMEOUT);
+	if (got != len) {
+		replay_flush(len - got);
+		xprintf("replay: upload timed out\r\n");
+		return -1;
+	}
+	if (replay_crc32((uint8_t *)recs, len) != crc) {
+		xprintf("replay: CRC mismatch\r\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (recs[i].dlc > 8 ||
+		    (i && (int32_t)(recs[i].ts - recs[i - 1].ts) < 0)) {
+			xprintf("replay: bad record %u\r\n", i);
+			return -1;
+		}
+		recs[i].ir &= ~1;	/* TXRQ is ours */
+	}
+	nrecs = n;
+	replay_durations();
+	return 0;
+}
+
+/* trace time to replay time */
+static uint32_t replay_scaled(uint32_t ts)
+{
+	return ((uint64_t)ts * scale) >> 16;
+}
+
+/* TIM2 alarm: start the staged mailbox and stage the next frame */
+static void replay_fire(void)
+{
+	uint32_t err;
+
+	if (staged_mb < 0)
+		return;
+	can_mb_fire(staged_mb);
+	err = timebase_now() - staged_due;
+
+	mb_due[staged_mb] = staged_due;
+	mb_rec[staged_mb] = next;
+	mb_active |= 1 << staged_mb;
+	staged_mb = -1;
+	next++;
+
+	if (err < trig_min)
+		trig_min = err;
+	if (err > trig_max)
+		trig_max = err;
+	trig_sum += err;
+	trig_n++;
+
+	replay_stage();
+}
+
+/* CAN TX interrupt: a mailbox completed */
+static void replay_tx_done(int mb, int ok, uint32_t now)
+{
+	int32_t err;
+
+	/* a frame queued before the replay started frees a mailbox too */
+	if (!(mb_active & (1 << mb))) {
+		replay_stage();
+		return;
+	}
+	mb_active &= ~(1 << mb);
+	if (ok) {
+		/* completion minus the frame's on-wire time approximates SOF */
+		err = now - recs[mb_rec[mb]].dur - mb_due[mb];
+		hist_add(&bus_err, err > 0 ? err : 0);
+	} else {
+		failed++;
+	}
+	replay_stage();
+}
+
+/* Load the next frame into a free mailbox and arm the alarm for it */
+static void replay_stage(void)
+{
+	struct replay_rec *r;
+
+	if (!running || staged_mb >= 0)
+		return;
+	if (next >= nrecs) {
+		if (!mb_active) {
+			run_us = timebase_now() - t0;
+			running = 0;
+		}
+		return;
+	}
+	r = &recs[next];
+	staged_mb = can_mb_stage(r->ir, r->data, r->dlc);
+	if (staged_mb < 0)
+		return;		/* retried from replay_tx_done() */
+	staged_due = t0 + replay_scaled(r->ts);
+	if ((int32_t)(staged_due - timebase_now()) < 0)
+		late++;
+	timebase_alarm(staged_due, replay_fire);
+}
+
+/*
+ * Play the loaded trace, `speed` in percent of the original pace.
+ * Returns at once, the schedule runs from interrupts.
+ */
+int replay_start(unsigned int speed)
+{
+	if (running || !nrecs || !speed)
+		return -1;
+	/* the bitrate changed since the upload */
+	if (dur_bitrate != can_bitrate)
+		replay_durations();
+
+	hist_reset(&bus_err);
+	trig_min = 0xffffffff;
+	trig_max = trig_n = 0;
+	trig_sum = 0;
+	late = failed = 0;
+	run_us = 0;
+	speed_pct = speed;
+	scale = ((uint32_t)100 << 16) / speed;
+	next = 0;
+	staged_mb = -1;
+	mb_active = 0;
+
+	can_tx_claim(replay_tx_done);
+	taskENTER_CRITICAL();
+	running = 1;
+	t0 = timebase_now() + REPLAY_LEAD_US - replay_scaled(recs[0].ts);
+	replay_stage();
+	taskEXIT_CRITICAL();
+	return 0;
+}
+
+void replay_stop()
+{
+	int i;
+
+	taskENTER_CRITICAL();
+	timebase_alarm_cancel();
+	if (running)
+		run_us = timebase_now() - t0;
+	/* aborted: don't leave frames retrying on a dead bus */
+	for (i = 0; i < CAN_NUM_MB; i++)
+		if (mb_active & (1 << i))
+			CAN_CancelTransmit(CANx, i);
+	running = 0;
+	staged_mb = -1;
+	mb_active = 0;
+	taskEXIT_CRITICAL();
+	can_tx_release();
+}
+
+int replay_running()
+{
+	return running;
+}
+
+void replay_dump()
+{
+	xprintf("Loaded: %u/%u frames", nrecs, REPLAY_FRAMES);
+	if (nrecs)
+		xprintf(", %u ms", (recs[nrecs - 1].ts - recs[0].ts) / 1000);
+	xprintf("\r\n");
+}
+
+void replay_stat_dump()
+{
+	xprintf("Sent: %u/%u frames in %u ms at %u%%\r\n",
+		trig_n, nrecs, run_us / 1000, speed_pct);
+	if (!trig_n)
+		return;
+	xprintf("Late: %u, failed: %u\r\n", late, failed);
+	xprintf("Trigger error (us): min %u avg %u max %u\r\n",
+		trig_min, (uint32_t)(trig_sum / trig_n), trig_max);
+	if (!bus_err.count)
+		return;
+	xprintf("SOF error (us): min %u avg %u p50 %u p99 %u max %u\r\n",
+		bus_err.min, hist_mean(&bus_err),
+		hist_quantile(&bus_err, 50, 100),
+		hist_quantile(&bus_err, 99, 100), bus_err.max);
+}
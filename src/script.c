@@ -0,0 +1,214 @@
+#include <string.h>
+#include "script.h"
+
+static int script_list(struct script *sc, const char *s, const char *e,
+		       int depth);
+
+static const char *skip_ws(const char *s, const char *e)
+{
+	while (s < e && *s == ' ')
+		s++;
+	return s;
+}
+
+/* end of the list item starting at `s`: next top level ';' or `e` */
+static const char *item_end(const char *s, const char *e)
+{
+	int level = 0;
+
+	for (; s < e; s++) {
+		if (*s == '{') {
+			level++;
+		} else if (*s == '}') {
+			if (--level < 0)
+				return NULL;
+		} else if (*s == ';' && !level) {
+			break;
+		}
+	}
+	return level ? NULL : s;
+}
+
+/* split off the next space separated word, returns its end */
+static const char *word(const char *s, const char *e)
+{
+	while (s < e && *s != ' ' && *s != '{' && *s != ';')
+		s++;
+	return s;
+}
+
+static int word_is(const char *s, const char *we, const char *kw)
+{
+	int n = strlen(kw);
+
+	return we - s == n && !memcmp(s, kw, n);
+}
+
+static const char *parse_uint(const char *s, const char *e, uint32_t *v)
+{
+	const char *p = s;
+
+	*v = 0;
+	while (p < e && *p >= '0' && *p <= '9')
+		*v = *v * 10 + *p++ - '0';
+	return p == s ? NULL : p;
+}
+
+/* `s`..`e` must be exactly "{ ... }", returns the inside in *bs, *be */
+static int block(const char *s, const char *e, const char **bs,
+		 const char **be)
+{
+	s = skip_ws(s, e);
+	if (s >= e || *s != '{' || e[-1] != '}' || item_end(s + 1, e - 1) == NULL)
+		return SCRIPT_ESYNTAX;
+	*bs = s + 1;
+	*be = e - 1;
+	return SCRIPT_OK;
+}
+
+static struct script_macro *macro_find(struct script *sc, const char *name,
+				       const char *ne)
+{
+	int i;
+
+	for (i = 0; i < SCRIPT_MACROS; i++)
+		if (sc->macro[i].name[0] &&
+		    word_is(name, ne, sc->macro[i].name))
+			return &sc->macro[i];
+	return NULL;
+}
+
+static int macro_def(struct script *sc, const char *name, const char *ne,
+		     const char *bs, const char *be)
+{
+	struct script_macro *m;
+	int i;
+
+	if (ne - name >= SCRIPT_NAME || be - bs >= SCRIPT_BODY)
+		return SCRIPT_ENOMEM;
+	m = macro_find(sc, name, ne);
+	for (i = 0; m == NULL && i < SCRIPT_MACROS; i++)
+		if (!sc->macro[i].name[0])
+			m = &sc->macro[i];
+	if (m == NULL)
+		return SCRIPT_ENOMEM;
+	memcpy(m->name, name, ne - name);
+	m->name[ne - name] = 0;
+	memcpy(m->body, bs, be - bs);
+	m->body[be - bs] = 0;
+	return SCRIPT_OK;
+}
+
+static int script_item(struct script *sc, const char *s, const char *e,
+		       int depth)
+{
+	struct script_macro *m;
+	const char *we, *bs, *be, *p;
+	uint32_t n;
+	int ret;
+
+	while (e > s && e[-1] == ' ')
+		e--;
+	if (s == e)
+		return SCRIPT_OK;
+
+	we = word(s, e);
+	if (word_is(s, we, "repeat")) {
+		p = parse_uint(skip_ws(we, e), e, &n);
+		if (p == NULL || block(p, e, &bs, &be) ||
+		    depth + 1 >= SCRIPT_DEPTH)
+			return SCRIPT_ESYNTAX;
+		/* 0 repeats until the script is aborted */
+		do {
+			if (sc->ops->abort())
+				return SCRIPT_EABORT;
+			ret = script_list(sc, bs, be, depth + 1);
+			if (ret)
+				return ret;
+		} while (!n || --n);
+		return SCRIPT_OK;
+	}
+	if (word_is(s, we, "def")) {
+		/* a running macro must not be redefined under its feet */
+		if (depth)
+			return SCRIPT_ESYNTAX;
+		s = skip_ws(we, e);
+		we = word(s, e);
+		if (s == we || block(we, e, &bs, &be))
+			return SCRIPT_ESYNTAX;
+		return macro_def(sc, s, we, bs, be);
+	}
+	if (word_is(s, we, "undef")) {
+		s = skip_ws(we, e);
+		m = macro_find(sc, s, word(s, e));
+		if (m == NULL || depth)
+			return SCRIPT_ESYNTAX;
+		m->name[0] = 0;
+		return SCRIPT_OK;
+	}
+	if (word_is(s, we, "usleep")) {
+		p = parse_uint(skip_ws(we, e), e, &n);
+		if (p == NULL || p != e)
+			return SCRIPT_ESYNTAX;
+		sc->t += n;
+		sc->ops->wait_until(sc->t);
+		return sc->ops->abort() ? SCRIPT_EABORT : SCRIPT_OK;
+	}
+	m = macro_find(sc, s, we);
+	if (m != NULL) {
+		if (we != e || depth + 1 >= SCRIPT_DEPTH)
+			return SCRIPT_ESYNTAX;
+		return script_list(sc, m->body, m->body + strlen(m->body),
+				   depth + 1);
+	}
+
+	/* simple command, handed over NUL terminated */
+	if (e - s >= SCRIPT_LINE)
+		return SCRIPT_ESYNTAX;
+	memcpy(sc->line, s, e - s);
+	sc->line[e - s] = 0;
+	return sc->ops->exec(sc->line);
+}
+
+static int script_list(struct script *sc, const char *s, const char *e,
+		       int depth)
+{
+	const char *ie;
+	int ret;
+
+	while (s < e) {
+		s = skip_ws(s, e);
+		ie = item_end(s, e);
+		if (ie == NULL)
+			return SCRIPT_ESYNTAX;
+		ret = script_item(sc, s, ie, depth);
+		if (ret)
+			return ret;
+		s = ie + 1;
+	}
+	return SCRIPT_OK;
+}
+
+void script_init(struct script *sc, const struct script_ops *ops)
+{
+	memset(sc, 0, sizeof(*sc));
+	sc->ops = ops;
+}
+
+/* Run one console line, the schedule starts now */
+int script_run(struct script *sc, const char *text)
+{
+	sc->t = sc->ops->now();
+	return script_list(sc, text, text + strlen(text), 0);
+}
+
+/* idx-th defined macro or NULL, for listing */
+const struct script_macro *script_macro(struct script *sc, int idx)
+{
+	int i;
+
+	for (i = 0; i < SCRIPT_MACROS; i++)
+		if (sc->macro[i].name[0] && !idx--)
+			return &sc->macro[i];
+	return NULL;
+}
@@ -0,0 +1,207 @@
+#include <string.h>
+#include "slcan.h"
+
+#define SLCAN_OK	'\r'
+#define SLCAN_ERR	'\a'
+
+static const unsigned int slcan_rates[] = {
+	10000, 20000, 50000, 100000, 125000,
+	250000, 500000, 800000, 1000000,
+};
+
+static const char hex[] = "0123456789ABCDEF";
+
+static int slcan_hex(const char *p, int n, uint32_t *v)
+{
+	int d;
+
+	*v = 0;
+	while (n--) {
+		if (*p >= '0' && *p <= '9')
+			d = *p - '0';
+		else if (*p >= 'a' && *p <= 'f')
+			d = *p - 'a' + 10;
+		else if (*p >= 'A' && *p <= 'F')
+			d = *p - 'A' + 10;
+		else
+			return -1;
+		*v = (*v << 4) | d;
+		p++;
+	}
+	return 0;
+}
+
+static char *slcan_put_hex(char *p, uint32_t v, int n)
+{
+	while (n--)
+		*p++ = hex[(v >> (4 * n)) & 0xf];
+	return p;
+}
+
+void slcan_init(struct slcan *s, const struct slcan_ops *ops)
+{
+	memset(s, 0, sizeof(*s));
+	s->ops = ops;
+	s->bitrate = 1000000;
+}
+
+/*
+ * Decode a t/T/r/R command: "tiiildd..", "Tiiiiiiiildd..", "riiil",
+ * "Riiiiiiiil". Returns 0 on success.
+ */
+int slcan_parse_frame(const char *cmd, struct slcan_frame *f)
+{
+	int idlen, i;
+	uint32_t v;
+
+	memset(f, 0, sizeof(*f));
+	switch (cmd[0]) {
+	case 'T':
+		f->ext = 1;
+		/* fall through */
+	case 't':
+		break;
+	case 'R':
+		f->ext = 1;
+		/* fall through */
+	case 'r':
+		f->rtr = 1;
+		break;
+	default:
+		return -1;
+	}
+	idlen = f->ext ? 8 : 3;
+	cmd++;
+	if (slcan_hex(cmd, idlen, &f->id))
+		return -1;
+	if (f->id > (f->ext ? 0x1fffffff : 0x7ff))
+		return -1;
+	cmd += idlen;
+	if (slcan_hex(cmd, 1, &v) || v > 8)
+		return -1;
+	f->dlc = v;
+	cmd++;
+	if (!f->rtr) {
+		for (i = 0; i < f->dlc; i++) {
+			if (slcan_hex(cmd, 2, &v))
+				return -1;
+			f->data[i] = v;
+			cmd += 2;
+		}
+	}
+	return *cmd ? -1 : 0;
+}
+
+/*
+ * Encode a received frame, `ts_ms` < 0 omits the timestamp.
+ * Returns the length written, buf must hold SLCAN_MTU bytes.
+ */
+int slcan_format_frame(char *buf, const struct slcan_frame *f, int ts_ms)
+{
+	char *p = buf;
+	int i;
+
+	*p++ = f->rtr ? (f->ext ? 'R' : 'r') : (f->ext ? 'T' : 't');
+	p = slcan_put_hex(p, f->id, f->ext ? 8 : 3);
+	*p++ = hex[f->dlc & 0xf];
+	if (!f->rtr)
+		for (i = 0; i < f->dlc && i < 8; i++)
+			p = slcan_put_hex(p, f->data[i], 2);
+	if (ts_ms >= 0)
+		p = slcan_put_hex(p, ts_ms % 60000, 4);
+	*p++ = '\r';
+	return p - buf;
+}
+
+/* Execute one command line (without the CR), returns reply length */
+int slcan_command(struct slcan *s, const char *cmd, char *reply)
+{
+	struct slcan_frame f;
+	int n = 0;
+
+	switch (cmd[0]) {
+	case 'S':
+		if (s->open || cmd[1] < '0' || cmd[1] > '8' || cmd[2])
+			goto err;
+		if (s->ops->bitrate(slcan_rates[cmd[1] - '0']))
+			goto err;
+		s->bitrate = slcan_rates[cmd[1] - '0'];
+		break;
+	case 'O':
+	case 'L':
+		if (s->open || cmd[1])
+			goto err;
+		if (s->ops->open(cmd[0] == 'L', s->timestamp))
+			goto err;
+		s->open = cmd[0];
+		break;
+	case 'C':
+		/* slcand closes before opening, accept it either way */
+		if (s->open)
+			s->ops->close();
+		s->open = 0;
+		break;
+	case 'Z':
+		if (s->open || (cmd[1] != '0' && cmd[1] != '1') || cmd[2])
+			goto err;
+		s->timestamp = cmd[1] == '1';
+		break;
+	case 't':
+	case 'T':
+	case 'r':
+	case 'R':
+		if (s->open != 'O' || slcan_parse_frame(cmd, &f))
+			goto err;
+		if (s->ops->xmit(&f))
+			goto err;
+		reply[n++] = f.ext ? 'Z' : 'z';
+		break;
+	case 'F':
+		if (!s->open)
+			goto err;
+		reply[n++] = 'F';
+		reply[n++] = '0';
+		reply[n++] = '0';
+		break;
+	case 'V':
+		memcpy(reply, "V1013", 5);
+		n += 5;
+		break;
+	case 'N':
+		memcpy(reply, "NUCAN", 5);
+		n += 5;
+		break;
+	default:
+		goto err;
+	}
+	reply[n++] = SLCAN_OK;
+	return n;
+err:
+	reply[0] = SLCAN_ERR;
+	return 1;
+}
+
+/*
+ * Feed one character from the host. Once a command is complete its
+ * reply is written to `reply` and the length returned, 0 otherwise.
+ */
+int slcan_input(struct slcan *s, char c, char *reply)
+{
+	if (c == '\n')
+		return 0;
+	if (c != '\r') {
+		if (s->pos < SLCAN_MTU - 1)
+			s->line[s->pos] = c;
+		s->pos++;
+		return 0;
+	}
+	if (s->pos == 0 || s->pos >= SLCAN_MTU) {
+		/* empty line is a no-op, overlong one is an error */
+		reply[0] = s->pos ? SLCAN_ERR : SLCAN_OK;
+		s->pos = 0;
+		return 1;
+	}
+	s->line[s->pos] = 0;
+	s->pos = 0;
+	return slcan_command(s, s->line, reply);
+}
@@ -29,6 +29,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f0xx_it.h"
+#include "prof.h"
 
 /** @addtogroup Template_Project
   * @{
@@ -39,6 +40,7 @@
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 /* Private function prototypes -----------------------------------------------*/
+extern void xPortSysTickHandler (void);
 /* Private functions ---------------------------------------------------------*/
 
 /******************************************************************************/
@@ -66,6 +68,19 @@ void HardFault_Handler(void)
   {
   }
 }
+
+/**
+  * @brief  This function handles SysTick Handler.
+  * @param  None
+  * @retval None
+  */
+void SysTick_Handler(void)
+{
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_TICK);
+
+  xPortSysTickHandler();
+  prof_isr_exit(PROF_IRQ_TICK, t0);
+}
 /******************************************************************************/
 /*                 STM32F0xx Peripherals Interrupt Handlers                   */
 /*  Add here the Interrupt Handler for the used peripheral(s) (PPP), for the  */
@@ -31,6 +31,7 @@
 #include "stm32fxxx_it.h"
 #include "usb_core.h"
 #include "usbd_core.h"
+#include "prof.h"
 
 #if defined (USE_STM322xG_EVAL)
  #include "stm322xg_eval.h"
@@ -59,6 +60,7 @@
 /* Private function prototypes -----------------------------------------------*/
 extern USB_OTG_CORE_HANDLE           USB_OTG_dev;
 extern uint32_t USBD_OTG_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
+extern void xPortSysTickHandler (void);
 
 #ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED 
 extern uint32_t USBD_OTG_EP1IN_ISR_Handler (USB_OTG_CORE_HANDLE *pdev);
@@ -162,9 +164,13 @@ void DebugMon_Handler(void)
   * @param  None
   * @retval None
   */
-/*void SysTick_Handler(void)
+void SysTick_Handler(void)
 {
-}*/
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_TICK);
+
+  xPortSysTickHandler();
+  prof_isr_exit(PROF_IRQ_TICK, t0);
+}
 
 /**
   * @brief  This function handles EXTI15_10_IRQ Handler.
@@ -174,6 +180,8 @@ void DebugMon_Handler(void)
 #ifdef USE_USB_OTG_FS  
 void OTG_FS_WKUP_IRQHandler(void)
 {
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_USB);
+
   if(USB_OTG_dev.cfg.low_power)
   {
     *(uint32_t *)(0xE000ED10) &= 0xFFFFFFF9 ; 
@@ -181,6 +189,7 @@ void OTG_FS_WKUP_IRQHandler(void)
     USB_OTG_UngateClock(&USB_OTG_dev);
   }
   EXTI_ClearITPendingBit(EXTI_Line18);
+  prof_isr_exit(PROF_IRQ_USB, t0);
 }
 #endif
 
@@ -192,6 +201,8 @@ void OTG_FS_WKUP_IRQHandler(void)
 #ifdef USE_USB_OTG_HS  
 void OTG_HS_WKUP_IRQHandler(void)
 {
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_USB);
+
   if(USB_OTG_dev.cfg.low_power)
   {
     *(uint32_t *)(0xE000ED10) &= 0xFFFFFFF9 ; 
@@ -199,6 +210,7 @@ void OTG_HS_WKUP_IRQHandler(void)
     USB_OTG_UngateClock(&USB_OTG_dev);
   }
   EXTI_ClearITPendingBit(EXTI_Line20);
+  prof_isr_exit(PROF_IRQ_USB, t0);
 }
 #endif
 
@@ -213,7 +225,10 @@ void OTG_HS_IRQHandler(void)
 void OTG_FS_IRQHandler(void)
 #endif
 {
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_USB);
+
   USBD_OTG_ISR_Handler (&USB_OTG_dev);
+  prof_isr_exit(PROF_IRQ_USB, t0);
 }
 
 #ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED 
@@ -224,7 +239,10 @@ void OTG_FS_IRQHandler(void)
   */
 void OTG_HS_EP1_IN_IRQHandler(void)
 {
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_USB);
+
   USBD_OTG_EP1IN_ISR_Handler (&USB_OTG_dev);
+  prof_isr_exit(PROF_IRQ_USB, t0);
 }
 
 /**
@@ -234,7 +252,10 @@ void OTG_HS_EP1_IN_IRQHandler(void)
   */
 void OTG_HS_EP1_OUT_IRQHandler(void)
 {
+  uint32_t t0 = prof_isr_enter(PROF_IRQ_USB);
+
   USBD_OTG_EP1OUT_ISR_Handler (&USB_OTG_dev);
+  prof_isr_exit(PROF_IRQ_USB, t0);
 }
 #endif
 
@@ -0,0 +1,109 @@
+#include "timebase.h"
+#include "prof.h"
+#ifdef TARGET_F407
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_tim.h"
+#include "misc.h"
+#endif
+#ifdef TARGET_F091
+#include "stm32f0xx_rcc.h"
+#include "stm32f0xx_tim.h"
+#include "stm32f0xx_misc.h"
+#endif
+
+/* upper 32 bits, bumped by the TIM2 update (overflow) interrupt */
+static volatile uint32_t timebase_hi;
+/* one-shot compare callback, run from the TIM2 interrupt */
+static void (*volatile alarm_fn)(void);
+
+void timebase_init()
+{
+	TIM_TimeBaseInitTypeDef tim;
+	NVIC_InitTypeDef nvic;
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+
+	TIM_TimeBaseStructInit(&tim);
+	tim.TIM_Prescaler = TIMEBASE_CLK_HZ / 1000000 - 1;
+	tim.TIM_Period = 0xffffffff;
+	tim.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseInit(TIMEBASE_TIM, &tim);
+	TIM_ClearITPendingBit(TIMEBASE_TIM, TIM_IT_Update);
+	TIM_ITConfig(TIMEBASE_TIM, TIM_IT_Update, ENABLE);
+
+	/*
+	 * Same priority as the CAN interrupts: alarm callbacks drive the TX
+	 * mailboxes and must not preempt the CAN TX handler, or vice versa.
+	 */
+	nvic.NVIC_IRQChannel = TIMEBASE_IRQ;
+#ifdef TARGET_F407
+	nvic.NVIC_IRQChannelPreemptionPriority = configMAX_SYSCALL_INTERRUPT_PRIORITY >> 4;
+	nvic.NVIC_IRQChannelSubPriority = 0x0;
+#endif
+#ifdef TARGET_F091
+	nvic.NVIC_IRQChannelPriority = configMAX_SYSCALL_INTERRUPT_PRIORITY >> 6;
+#endif
+	nvic.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&nvic);
+
+	TIM_Cmd(TIMEBASE_TIM, ENABLE);
+}
+
+/* 64-bit microseconds, callable from tasks and ISRs */
+uint64_t timebase_now64()
+{
+	UBaseType_t mask;
+	uint32_t hi, lo;
+
+	mask = portSET_INTERRUPT_MASK_FROM_ISR();
+	hi = timebase_hi;
+	lo = TIMEBASE_TIM->CNT;
+	/* wrapped, but the update interrupt has not run yet */
+	if ((TIMEBASE_TIM->SR & TIM_SR_UIF) && lo < 0x80000000)
+		hi++;
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Call `fn` from the TIM2 interrupt once the timebase reaches `t`. A time
+ * already passed fires at once. Call with the interrupt masked or from
+ * an alarm callback.
+ */
+void timebase_alarm(uint32_t t, void (*fn)(void))
+{
+	alarm_fn = fn;
+	TIMEBASE_TIM->CCR1 = t;
+	TIMEBASE_TIM->SR = ~TIM_SR_CC1IF;
+	TIMEBASE_TIM->DIER |= TIM_DIER_CC1IE;
+	/* the compare only matches on equality, don't wait for the wrap */
+	if ((int32_t)(t - TIMEBASE_TIM->CNT) <= 0)
+		TIMEBASE_TIM->EGR = TIM_EGR_CC1G;
+}
+
+void timebase_alarm_cancel()
+{
+	TIMEBASE_TIM->DIER &= ~TIM_DIER_CC1IE;
+	TIMEBASE_TIM->SR = ~TIM_SR_CC1IF;
+	alarm_fn = NULL;
+}
+
+void TIM2_IRQHandler(void)
+{
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_TIMEBASE);
+	uint32_t sr = TIMEBASE_TIM->SR;
+	void (*fn)(void);
+
+	if (sr & TIM_SR_UIF) {
+		TIMEBASE_TIM->SR = ~TIM_SR_UIF;
+		timebase_hi++;
+	}
+	if ((sr & TIM_SR_CC1IF) && (TIMEBASE_TIM->DIER & TIM_DIER_CC1IE)) {
+		TIMEBASE_TIM->DIER &= ~TIM_DIER_CC1IE;
+		TIMEBASE_TIM->SR = ~TIM_SR_CC1IF;
+		fn = alarm_fn;
+		if (fn)
+			fn();
+	}
+	prof_isr_exit(PROF_IRQ_TIMEBASE, t0);
+}
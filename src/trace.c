@@ -0,0 +1,103 @@
+#include "FreeRTOS.h"
+#include "task.h"
+#include "prof.h"
+#include "trace.h"
+#include "fmt.h"
+
+#ifdef TARGET_F407
+/* next to the capture buffer in the core coupled RAM */
+static struct trace_event trace_buf[TRACE_EVENTS]
+	__attribute__((section(".ccmram")));
+#else
+static struct trace_event trace_buf[TRACE_EVENTS];
+#endif
+_Static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0,
+	       "TRACE_EVENTS must be a power of two");
+
+static volatile unsigned int trace_in;	/* events recorded, free running */
+volatile uint32_t trace_mask;
+
+/* any context; the stamp and the slot are taken together */
+void trace_event(int type, int arg, int data)
+{
+	struct trace_event *e;
+	uint32_t pm = __get_PRIMASK();
+
+	__disable_irq();
+	e = &trace_buf[trace_in++ & (TRACE_EVENTS - 1)];
+	e->ts = prof_now();
+	e->type = type;
+	e->arg = arg;
+	e->data = data;
+	__set_PRIMASK(pm);
+}
+
+void trace_start(uint32_t mask)
+{
+	taskENTER_CRITICAL();
+	trace_in = 0;
+	trace_mask = mask & TRACE_ALL;
+	taskEXIT_CRITICAL();
+}
+
+void trace_stop()
+{
+	trace_mask = 0;
+}
+
+void trace_status()
+{
+	unsigned int n = trace_in;
+	struct trace_event *first, *last;
+
+	xprintf("State: %s, mask %x\r\n", trace_mask ? "recording" : "stopped",
+		trace_mask);
+	xprintf("Events: %u/%u (%u seen)\r\n",
+		n < TRACE_EVENTS ? n : TRACE_EVENTS, TRACE_EVENTS, n);
+	if (!n || trace_mask)
+		return;
+	first = &trace_buf[(n > TRACE_EVENTS ? n - TRACE_EVENTS : 0) &
+			   (TRACE_EVENTS - 1)];
+	last = &trace_buf[(n - 1) & (TRACE_EVENTS - 1)];
+	xprintf("Window: %u us\r\n",
+		(last->ts - first->ts) / (PROF_HZ / 1000000));
+}
+
+/*
+ * Stopped buffer, oldest first: a text header naming the tasks and
+ * interrupts, then the raw little-endian events.
+ *
+ *	TRACE <events> <clock Hz>
+ *	T <task number> <name>
+ *	I <enum prof_irq> <name>
+ *	DATA <bytes>
+ *	<events * sizeof(struct trace_event)>
+ *	END
+ */
+int trace_dump()
+{
+	static TaskStatus_t ts[PROF_TASKS];
+	unsigned int n = trace_in, first, len;
+	int i, nt;
+
+	if (trace_mask)
+		return -1;
+	first = n > TRACE_EVENTS ? n - TRACE_EVENTS : 0;
+	n -= first;
+	first &= TRACE_EVENTS - 1;
+
+	nt = uxTaskGetSystemState(ts, PROF_TASKS, NULL);
+	xprintf("TRACE %u %u\r\n", n, PROF_HZ);
+	for (i = 0; i < nt; i++)
+		xprintf("T %u %s\r\n", (unsigned int)ts[i].xTaskNumber,
+			ts[i].pcTaskName);
+	for (i = 0; i < PROF_IRQS; i++)
+		xprintf("I %d %s\r\n", i, prof_irq_names[i]);
+	xprintf("DATA %u\r\n", n * (unsigned int)sizeof(struct trace_event));
+	/* at most two runs: up to the end of the ring, then from its start */
+	len = TRACE_EVENTS - first < n ? TRACE_EVENTS - first : n;
+	xwrite((char *)&trace_buf[first], len * sizeof(struct trace_event));
+	xwrite((char *)trace_buf, (n - len) * sizeof(struct trace_event));
+	xprintf("\r\nEND\r\n");
+	return 0;
+}
@@ -0,0 +1,237 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "stm32f0xx.h"
+#include "stm32f0xx_gpio.h"
+#include "stm32f0xx_rcc.h"
+#include "stm32f0xx_usart.h"
+#include "stm32f0xx_dma.h"
+#include "stm32f0xx_misc.h"
+#include "newlib_stubs.h"
+#include "usart_dma.h"
+#include "prof.h"
+
+/*
+ * TX: _write() copies into tx_buf, DMA1 channel 4 sends the contiguous
+ * part from tx_out and the TC interrupt chains the next one.
+ * RX: DMA1 channel 5 runs circularly over rx_dma, half/full transfer and
+ * idle line interrupts move what arrived to stdin_ring.
+ */
+
+#define TX_DMA		DMA1_Channel4
+#define RX_DMA		DMA1_Channel5
+
+static uint8_t tx_buf[USART_TX_BUF_LEN];
+static volatile unsigned int tx_in, tx_out;
+static volatile unsigned int tx_dma_len;	/* in flight, 0 when idle */
+static volatile TaskHandle_t tx_waiter;
+
+static uint8_t rx_dma[USART_RX_DMA_LEN];
+static unsigned int rx_pos;
+
+uint32_t usart_rx_dropped;
+
+static USART_InitTypeDef usart_init = {
+	.USART_BaudRate = USART_BAUD_DFL,
+	.USART_WordLength = USART_WordLength_8b,
+	.USART_Parity = USART_Parity_No,
+	.USART_StopBits = USART_StopBits_1,
+	.USART_HardwareFlowControl = USART_HardwareFlowControl_None,
+	.USART_Mode = USART_Mode_Tx | USART_Mode_Rx
+};
+
+/* Start the next TX chunk if idle, interrupts masked */
+static void usart_tx_start(void)
+{
+	unsigned int off, n;
+
+	if (tx_dma_len || tx_in == tx_out)
+		return;
+	off = tx_out & (USART_TX_BUF_LEN - 1);
+	n = tx_in - tx_out;
+	if (n > USART_TX_BUF_LEN - off)
+		n = USART_TX_BUF_LEN - off;
+	tx_dma_len = n;
+	TX_DMA->CCR &= ~DMA_CCR_EN;
+	TX_DMA->CMAR = (uint32_t)&tx_buf[off];
+	TX_DMA->CNDTR = n;
+	TX_DMA->CCR |= DMA_CCR_EN;
+}
+
+/*
+ * Queue up to `len` bytes without blocking, returns the number queued.
+ * Single writer: _write() callers are serialized by the caller.
+ */
+int usart_dma_write(const char *buf, int len)
+{
+	unsigned int in = tx_in;
+	unsigned int off = in & (USART_TX_BUF_LEN - 1);
+	unsigned int space = USART_TX_BUF_LEN - (in - tx_out);
+	unsigned int n;
+	uint32_t pm;
+
+	if ((unsigned int)len > space)
+		len = space;
+	n = USART_TX_BUF_LEN - off;
+	if (n > (unsigned int)len)
+		n = len;
+	memcpy(&tx_buf[off], buf, n);
+	memcpy(&tx_buf[0], buf + n, len - n);
+	__asm__ __volatile__("" ::: "memory");
+	tx_in = in + len;
+	/* not taskENTER_CRITICAL(): callers may have interrupts masked */
+	pm = __get_PRIMASK();
+	__disable_irq();
+	usart_tx_start();
+	__set_PRIMASK(pm);
+	return len;
+}
+
+/* Sleep until the TX interrupt frees some room, or a tick passes */
+void usart_dma_wait(void)
+{
+	if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+		return;
+	tx_waiter = xTaskGetCurrentTaskHandle();
+	if (tx_in - tx_out >= USART_TX_BUF_LEN)
+		ulTaskNotifyTake(pdTRUE, 1);
+}
+
+/* Move newly DMAed bytes to stdin */
+static void usart_rx_drain(void)
+{
+	unsigned int pos = USART_RX_DMA_LEN - RX_DMA->CNDTR;
+
+	if (pos == USART_RX_DMA_LEN)
+		pos = 0;
+	while (rx_pos != pos) {
+		if (ring_full(&stdin_ring)) {
+			usart_rx_dropped++;
+		} else {
+			*ring_head(&stdin_ring) = rx_dma[rx_pos];
+			ring_push(&stdin_ring);
+		}
+		rx_pos = (rx_pos + 1) % USART_RX_DMA_LEN;
+	}
+}
+
+void DMA1_Channel4_5_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_DMA);
+
+	if (DMA_GetITStatus(DMA1_IT_TC4)) {
+		DMA_ClearITPendingBit(DMA1_IT_TC4);
+		tx_out += tx_dma_len;
+		tx_dma_len = 0;
+		usart_tx_start();
+		if (tx_waiter)
+			vTaskNotifyGiveFromISR(tx_waiter, &woken);
+	}
+	if (DMA_GetITStatus(DMA1_IT_HT5) || DMA_GetITStatus(DMA1_IT_TC5)) {
+		DMA_ClearITPendingBit(DMA1_IT_HT5 | DMA1_IT_TC5);
+		usart_rx_drain();
+		stdin_wakeup_from_isr(&woken);
+	}
+	prof_isr_exit(PROF_IRQ_DMA, t0);
+	portEND_SWITCHING_ISR(woken);
+}
+
+void USART2_IRQHandler(void)
+{
+	BaseType_t woken = pdFALSE;
+	uint32_t t0 = prof_isr_enter(PROF_IRQ_USART);
+
+	if (USART_GetFlagStatus(USART2, USART_FLAG_ORE)) {
+		USART_ClearFlag(USART2, USART_FLAG_ORE);
+		usart_rx_dropped++;
+	}
+	if (USART_GetFlagStatus(USART2, USART_FLAG_IDLE)) {
+		USART_ClearFlag(USART2, USART_FLAG_IDLE);
+		/* same priority as the DMA interrupt: no race on rx_pos */
+		usart_rx_drain();
+		stdin_wakeup_from_isr(&woken);
+	}
+	prof_isr_exit(PROF_IRQ_USART, t0);
+	portEND_SWITCHING_ISR(woken);
+}
+
+void usart_dma_init(unsigned int baud)
+{
+	GPIO_InitTypeDef gpio;
+	DMA_InitTypeDef dma;
+	NVIC_InitTypeDef nvic;
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, ENABLE);
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA | RCC_AHBPeriph_DMA1, ENABLE);
+
+	GPIO_PinAFConfig(GPIOA, GPIO_PinSource2, GPIO_AF_1);
+	GPIO_PinAFConfig(GPIOA, GPIO_PinSource3, GPIO_AF_1);
+	gpio.GPIO_Mode = GPIO_Mode_AF;
+	gpio.GPIO_Speed = GPIO_Speed_Level_3;
+	gpio.GPIO_OType = GPIO_OType_PP;
+	gpio.GPIO_PuPd = GPIO_PuPd_NOPULL;
+	gpio.GPIO_Pin = GPIO_Pin_2 | GPIO_Pin_3;
+	GPIO_Init(GPIOA, &gpio);
+
+	usart_init.USART_BaudRate = baud;
+	USART_Init(USART2, &usart_init);
+
+	DMA_RemapConfig(DMA1, DMA1_CH4_USART2_TX);
+	DMA_RemapConfig(DMA1, DMA1_CH5_USART2_RX);
+
+	DMA_StructInit(&dma);
+	dma.DMA_PeripheralBaseAddr = (uint32_t)&USART2->TDR;
+	dma.DMA_MemoryBaseAddr = (uint32_t)tx_buf;
+	dma.DMA_DIR = DMA_DIR_PeripheralDST;
+	dma.DMA_BufferSize = 1;
+	dma.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	dma.DMA_Priority = DMA_Priority_Low;
+	DMA_Init(TX_DMA, &dma);
+	DMA_ITConfig(TX_DMA, DMA_IT_TC, ENABLE);
+
+	dma.DMA_PeripheralBaseAddr = (uint32_t)&USART2->RDR;
+	dma.DMA_MemoryBaseAddr = (uint32_t)rx_dma;
+	dma.DMA_DIR = DMA_DIR_PeripheralSRC;
+	dma.DMA_BufferSize = USART_RX_DMA_LEN;
+	dma.DMA_Mode = DMA_Mode_Circular;
+	dma.DMA_Priority = DMA_Priority_High;
+	DMA_Init(RX_DMA, &dma);
+	DMA_ITConfig(RX_DMA, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	DMA_Cmd(RX_DMA, ENABLE);
+
+	USART_DMACmd(USART2, USART_DMAReq_Tx | USART_DMAReq_Rx, ENABLE);
+	USART_ITConfig(USART2, USART_IT_IDLE, ENABLE);
+
+	nvic.NVIC_IRQChannelPriority = configMAX_SYSCALL_INTERRUPT_PRIORITY >> 6;
+	nvic.NVIC_IRQChannelCmd = ENABLE;
+	nvic.NVIC_IRQChannel = USART2_IRQn;
+	NVIC_Init(&nvic);
+	nvic.NVIC_IRQChannel = DMA1_Channel4_5_IRQn;
+	NVIC_Init(&nvic);
+
+	USART_Cmd(USART2, ENABLE);
+}
+
+/*
+ * Switch the console baud rate once pending output is out. The ST-LINK
+ * VCP on the Nucleo goes up to 3 Mbaud, the oversampling by 16 limit.
+ * Returns -1 if the rate is out of range.
+ */
+int usart_set_baud(unsigned int baud)
+{
+	RCC_ClocksTypeDef clk;
+
+	RCC_GetClocksFreq(&clk);
+	if (baud < 1200 || baud > clk.USART2CLK_Frequency / 16)
+		return -1;
+	while (tx_in != tx_out)
+		vTaskDelay(1);
+	while (!USART_GetFlagStatus(USART2, USART_FLAG_TC))
+		;
+	USART_Cmd(USART2, DISABLE);
+	usart_init.USART_BaudRate = baud;
+	USART_Init(USART2, &usart_init);
+	USART_Cmd(USART2, ENABLE);
+	return 0;
+}
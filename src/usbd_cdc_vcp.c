@@ -2,6 +2,7 @@
 #pragma     data_alignment = 4 
 #endif /* USB_OTG_HS_INTERNAL_DMA_ENABLED */
 
+#include <string.h>
 #include "usbd_cdc_vcp.h"
 #include "usb_conf.h"
 #include "newlib_stubs.h"
@@ -14,6 +15,9 @@ extern uint8_t  APP_Rx_Buffer[]; /* Write CDC received data in this buffer.
 extern uint32_t APP_Rx_ptr_in;    /* Increment this pointer or roll it back to
                                      start address when writing received data
                                      in the buffer APP_Rx_Buffer. */
+extern uint32_t APP_Rx_ptr_out;
+
+uint32_t VCP_tx_dropped;
 
 static uint16_t VCP_Init(void);
 static uint16_t VCP_DeInit(void);
@@ -46,23 +50,94 @@ static uint16_t VCP_Ctrl (uint32_t Cmd, uint8_t* Buf, uint32_t Len)
 
 uint16_t VCP_DataTx(uint8_t* Buf)
 {
-	APP_Rx_Buffer[APP_Rx_ptr_in] = Buf[0];
-	APP_Rx_ptr_in++;
-	if (APP_Rx_ptr_in >= APP_RX_DATA_SIZE)
-		APP_Rx_ptr_in = 0;
-	return USBD_OK;
+	return VCP_Write(Buf, 1) == 1 ? USBD_OK : USBD_FAIL;
+}
+
+/*
+ * Bytes that can be queued without touching unsent data. APP_Rx_ptr_out
+ * is advanced when a transfer starts, so the packet in flight right
+ * before it is kept too.
+ */
+uint32_t VCP_WriteSpace(void)
+{
+	uint32_t out = APP_Rx_ptr_out;
+	uint32_t used;
+
+	if (out >= APP_RX_DATA_SIZE)
+		out = 0;
+	used = (APP_Rx_ptr_in + APP_RX_DATA_SIZE - out) % APP_RX_DATA_SIZE;
+	if (used + 1 + CDC_DATA_IN_PACKET_SIZE >= APP_RX_DATA_SIZE)
+		return 0;
+	return APP_RX_DATA_SIZE - 1 - CDC_DATA_IN_PACKET_SIZE - used;
+}
+
+/*
+ * Queue up to `len` bytes for the IN endpoint, never overwriting unsent
+ * data. Returns the number of bytes queued, less than `len` if the
+ * buffer is full. Single writer: callers must serialize.
+ */
+uint32_t VCP_Write(const uint8_t *buf, uint32_t len)
+{
+	uint32_t in = APP_Rx_ptr_in;
+	uint32_t n;
+
+	n = VCP_WriteSpace();
+	if (len > n)
+		len = n;
+	n = APP_RX_DATA_SIZE - in;
+	if (n > len)
+		n = len;
+	memcpy(&APP_Rx_Buffer[in], buf, n);
+	memcpy(&APP_Rx_Buffer[0], buf + n, len - n);
+	/* data must be in place before the USB ISR sees the new index */
+	__asm__ __volatile__("" ::: "memory");
+	APP_Rx_ptr_in = (in + len) % APP_RX_DATA_SIZE;
+	/* full packets go out now rather than on the next SOF interval */
+	usbd_cdc_Kick(0);
+	return len;
 }
 
+/* Send whatever is queued without waiting for a full packet */
+void VCP_Flush(void)
+{
+	usbd_cdc_Kick(1);
+}
+
+static uint32_t VCP_RxSpace(void)
+{
+	return ring_size(&stdin_ring) - ring_len(&stdin_ring);
+}
+
+/*
+ * Copy an OUT packet into the stdin ring. Returns USBD_BUSY once there
+ * is no room for another packet: the CDC core then leaves the endpoint
+ * NAKing until VCP_RxResume(). Packets therefore always fit.
+ */
 static uint16_t VCP_DataRx(uint8_t* Buf, uint32_t Len)
 {
-	uint32_t i;
-  
-	for (i = 0; i < Len; i++) {
-		if (stdin_buffer_in >= STDIN_BUFFER_SIZE)
-			stdin_buffer_in=0;
-		stdin_buffer[stdin_buffer_in++] = Buf[i];
-		if (stdin_buffer_len < STDIN_BUFFER_SIZE)
-			stdin_buffer_len++;
-	} 
-  return USBD_OK;
+	BaseType_t woken = pdFALSE;
+	uint32_t in = stdin_ring.in;
+	uint32_t off = in & (STDIN_BUFFER_SIZE - 1);
+	uint32_t n;
+
+	if (Len > VCP_RxSpace())
+		Len = VCP_RxSpace();
+	n = STDIN_BUFFER_SIZE - off;
+	if (n > Len)
+		n = Len;
+	memcpy(&stdin_ring.buf[off], Buf, n);
+	memcpy(&stdin_ring.buf[0], Buf + n, Len - n);
+	ring_barrier();
+	stdin_ring.in = in + Len;
+	stdin_wakeup_from_isr(&woken);
+	/* only pends the switch, it happens once the USB ISR returns */
+	portEND_SWITCHING_ISR(woken);
+	return VCP_RxSpace() >= CDC_DATA_OUT_PACKET_SIZE ? USBD_OK : USBD_BUSY;
+}
+
+/* Consumer side: re-arm the OUT endpoint if it was held off and a packet fits */
+void VCP_RxResume(void)
+{
+	if (VCP_RxSpace() >= CDC_DATA_OUT_PACKET_SIZE)
+		usbd_cdc_RxResume();
 }
@@ -53,9 +53,15 @@
 /** @defgroup USBD_DESC_Private_Defines
   * @{
   */ 
+#ifdef USE_GS_USB
+#include "gs_usb.h"
+#define USBD_VID                        GS_USB_VID
+#define USBD_PID                        GS_USB_PID
+#else
 #define USBD_VID                        0x0483
 
 #define USBD_PID                        0x5740
+#endif
 
 /** @defgroup USB_String_Descriptors
   * @{
@@ -66,7 +72,11 @@
 #define USBD_PRODUCT_HS_STRING          "STM32 Virtual ComPort in HS mode"
 #define USBD_SERIALNUMBER_HS_STRING     "00000000050B"
 
+#ifdef USE_GS_USB
+#define USBD_PRODUCT_FS_STRING          "uCAN gs_usb"
+#else
 #define USBD_PRODUCT_FS_STRING          "STM32 Virtual ComPort in FS Mode"
+#endif
 #define USBD_SERIALNUMBER_FS_STRING     "00000000050C"
 
 #define USBD_CONFIGURATION_HS_STRING    "VCP Config"
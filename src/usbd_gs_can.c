@@ -0,0 +1,442 @@
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "usbd_gs_can.h"
+#include "usbd_desc.h"
+#include "usbd_req.h"
+#include "usb_dcd.h"
+#include "misc.h"
+#include "can.h"
+#include "ring.h"
+#include "timebase.h"
+#include "gs_usb.h"
+
+/*
+ * gs_usb device class: one vendor specific interface with a bulk IN
+ * and a bulk OUT endpoint carrying struct gs_host_frame, bit timing
+ * and mode are set with vendor control requests (see gs_usb.c).
+ *
+ * USB ISR -> task_gs: frames from the host are received into a packet
+ * buffer and copied to the OUT ring, the endpoint is left NAKing while
+ * the ring is full. Requests that reconfigure the controller are
+ * checked in the interrupt and deferred to the task, they may not run
+ * in the USB interrupt.
+ * CAN TX ISR -> task_gs: completed transmissions, to be echoed.
+ * task_gs -> USB ISR: received frames and TX echoes are queued to the
+ * IN ring and sent one frame per transfer.
+ */
+
+#define GS_CONFIG_DESC_SIZE	(9 + 9 + 7 + 7)
+#define GS_ECHO_SLOTS		16	/* TX frames in flight, Linux uses 10 */
+
+/* host frame as received, `len` is checked by gs_frame_decode() */
+struct gs_out_frame {
+	struct gs_host_frame hf;
+	int len;
+};
+
+RING_DECLARE(gs_in_ring, struct gs_host_frame, GS_IN_QUEUE_LEN);
+RING_DECLARE(gs_out_ring, struct gs_out_frame, GS_OUT_QUEUE_LEN);
+static struct gs_in_ring gs_in;
+static struct gs_out_ring gs_out;
+/* a full packet: the host may send more than a host frame */
+__ALIGN_BEGIN static uint8_t gs_out_buf[GS_MAX_PACKET_SIZE] __ALIGN_END;
+
+/* echoes of the frames in flight, sent once they are on the bus */
+static struct gs_host_frame gs_echo[GS_ECHO_SLOTS];
+static uint32_t gs_echo_busy;	/* slot bitmap, task_gs only */
+
+struct gs_tx_done {
+	uint8_t slot;
+	uint8_t ok;
+	uint32_t ts;
+};
+/* one entry per busy slot at most, it cannot overflow */
+RING_DECLARE(gs_done_ring, struct gs_tx_done, GS_ECHO_SLOTS);
+static struct gs_done_ring gs_done;
+
+static void *gs_pdev;
+static volatile int gs_in_busy, gs_out_nak;
+static volatile TaskHandle_t gs_task;
+
+/* host-to-device control requests, handled by task_gs */
+struct gs_ctrl_req {
+	uint8_t req;
+	uint16_t wvalue;
+	uint16_t len;
+	uint32_t buf[5];	/* largest is struct gs_device_bittiming */
+};
+RING_DECLARE(gs_ctrl_ring, struct gs_ctrl_req, 4);
+static struct gs_ctrl_ring gs_ctrl;
+static uint32_t gs_ctrl_buf[16];
+/* task_gs refused a queued request, stall the next one */
+static volatile int gs_ctrl_err;
+
+static const struct gs_device_bt_const gs_bt_const = {
+	.feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_HW_TIMESTAMP,
+	.fclk_can = CAN_CLK_HZ,
+	.tseg1_min = 1,
+	.tseg1_max = 16,
+	.tseg2_min = 1,
+	.tseg2_max = 8,
+	.sjw_max = 4,
+	.brp_min = 1,
+	.brp_max = 1024,
+	.brp_inc = 1,
+};
+
+static int gs_bittiming(unsigned int brp, unsigned int tseg1,
+			unsigned int tseg2, unsigned int sjw)
+{
+	return can_set_timing(brp, tseg1, tseg2, sjw);
+}
+
+static int gs_start(uint32_t flags)
+{
+	can_set_listen(!!(flags & GS_CAN_FEATURE_LISTEN_ONLY));
+	can_filter_setup(can_id, 0);
+	return 0;
+}
+
+static void gs_reset(void)
+{
+	can_xmit_cancel();
+}
+
+static uint32_t gs_timestamp(void)
+{
+	return timebase_now();
+}
+
+static const struct gs_can_ops gs_ops = {
+	.bittiming = gs_bittiming,
+	.start = gs_start,
+	.reset = gs_reset,
+	.timestamp = gs_timestamp,
+};
+
+static struct gs_can gs_can = {
+	.ops = &gs_ops,
+	.bt_const = &gs_bt_const,
+	.sw_version = 2,
+};
+
+__ALIGN_BEGIN static uint8_t gs_cfg_desc[GS_CONFIG_DESC_SIZE] __ALIGN_END = {
+	/* configuration */
+	0x09,
+	USB_CONFIGURATION_DESCRIPTOR_TYPE,
+	GS_CONFIG_DESC_SIZE,
+	0x00,
+	0x01,		/* bNumInterfaces */
+	0x01,		/* bConfigurationValue */
+	0x00,		/* iConfiguration */
+	0xc0,		/* bmAttributes: self powered */
+	0x32,		/* MaxPower */
+	/* interface 0: vendor specific */
+	0x09,
+	USB_INTERFACE_DESCRIPTOR_TYPE,
+	0x00,		/* bInterfaceNumber */
+	0x00,		/* bAlternateSetting */
+	0x02,		/* bNumEndpoints */
+	0xff,		/* bInterfaceClass: vendor */
+	0xff,		/* bInterfaceSubClass */
+	0xff,		/* bInterfaceProtocol */
+	0x00,		/* iInterface */
+	/* bulk IN */
+	0x07,
+	USB_ENDPOINT_DESCRIPTOR_TYPE,
+	GS_IN_EP,
+	0x02,		/* bmAttributes: bulk */
+	LOBYTE(GS_MAX_PACKET_SIZE),
+	HIBYTE(GS_MAX_PACKET_SIZE),
+	0x00,
+	/* bulk OUT */
+	0x07,
+	USB_ENDPOINT_DESCRIPTOR_TYPE,
+	GS_OUT_EP,
+	0x02,
+	LOBYTE(GS_MAX_PACKET_SIZE),
+	HIBYTE(GS_MAX_PACKET_SIZE),
+	0x00,
+};
+
+/* USB ISR context from here on, up to task_gs() */
+
+static uint8_t gs_ep0_rx_ready(void *pdev);
+
+static void gs_in_start(void *pdev)
+{
+	if (gs_in_busy || ring_empty(&gs_in))
+		return;
+	gs_in_busy = 1;
+	DCD_EP_Tx(pdev, GS_IN_EP, (uint8_t *)ring_tail(&gs_in),
+		  gs_frame_size(&gs_can));
+}
+
+static void gs_out_arm(void *pdev)
+{
+	if (ring_full(&gs_out)) {
+		gs_out_nak = 1;
+		return;
+	}
+	gs_out_nak = 0;
+	DCD_EP_PrepareRx(pdev, GS_OUT_EP, gs_out_buf, sizeof(gs_out_buf));
+}
+
+static uint8_t gs_init(void *pdev, uint8_t cfgidx)
+{
+	gs_pdev = pdev;
+	ring_init(&gs_in);
+	ring_init(&gs_out);
+	ring_init(&gs_ctrl);
+	gs_ctrl_err = 0;
+	gs_in_busy = 0;
+	DCD_EP_Open(pdev, GS_IN_EP, GS_MAX_PACKET_SIZE, USB_OTG_EP_BULK);
+	DCD_EP_Open(pdev, GS_OUT_EP, GS_MAX_PACKET_SIZE, USB_OTG_EP_BULK);
+	gs_out_arm(pdev);
+	return USBD_OK;
+}
+
+static uint8_t gs_deinit(void *pdev, uint8_t cfgidx)
+{
+	DCD_EP_Close(pdev, GS_IN_EP);
+	DCD_EP_Close(pdev, GS_OUT_EP);
+	gs_can.started = 0;
+	return USBD_OK;
+}
+
+static uint8_t gs_setup(void *pdev, USB_SETUP_REQ *req)
+{
+	struct gs_ctrl_req *r;
+	int len;
+
+	/* wValue is left to gs_ctrl_in()/gs_ctrl_out() */
+	if ((req->bmRequest & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_VENDOR)
+		goto err;
+	if (req->bmRequest & 0x80) {
+		if (req->wLength > sizeof(gs_ctrl_buf))
+			goto err;
+		len = gs_ctrl_in(&gs_can, req->bRequest, req->wValue,
+				 gs_ctrl_buf, req->wLength);
+		if (len < 0)
+			goto err;
+		USBD_CtlSendData(pdev, (uint8_t *)gs_ctrl_buf, len);
+		return USBD_OK;
+	}
+	if (ring_full(&gs_ctrl) || req->wLength > sizeof(r->buf))
+		goto err;
+	r = ring_head(&gs_ctrl);
+	r->req = req->bRequest;
+	r->wvalue = req->wValue;
+	r->len = req->wLength;
+	if (r->len)
+		USBD_CtlPrepareRx(pdev, (uint8_t *)r->buf, r->len);
+	else if (gs_ep0_rx_ready(pdev) != USBD_OK)
+		return USBD_FAIL;
+	return USBD_OK;
+err:
+	USBD_CtlError(pdev, req);
+	return USBD_FAIL;
+}
+
+/*
+ * Data stage of a host-to-device request is in. Malformed requests are
+ * stalled here, so the status stage the core sends next is answered
+ * with a STALL. The rest goes to task_gs; the few it refuses for the
+ * device state (BITTIMING or START while started) are already past
+ * their status stage and fail the next host-to-device request instead.
+ */
+static uint8_t gs_ep0_rx_ready(void *pdev)
+{
+	struct gs_ctrl_req *r = ring_head(&gs_ctrl);
+	BaseType_t woken = pdFALSE;
+
+	if (gs_ctrl_err ||
+	    gs_ctrl_check(&gs_can, r->req, r->wvalue, r->buf, r->len)) {
+		gs_ctrl_err = 0;
+		USBD_CtlError(pdev, NULL);
+		return USBD_FAIL;
+	}
+	ring_push(&gs_ctrl);
+	if (gs_task)
+		vTaskNotifyGiveFromISR(gs_task, &woken);
+	portEND_SWITCHING_ISR(woken);
+	return USBD_OK;
+}
+
+static uint8_t gs_data_in(void *pdev, uint8_t epnum)
+{
+	BaseType_t woken = pdFALSE;
+
+	ring_pop(&gs_in);
+	gs_in_busy = 0;
+	gs_in_start(pdev);
+	/* task_gs may be waiting for room */
+	if (gs_task && ring_len(&gs_in) == GS_IN_QUEUE_LEN / 2)
+		vTaskNotifyGiveFromISR(gs_task, &woken);
+	portEND_SWITCHING_ISR(woken);
+	return USBD_OK;
+}
+
+static uint8_t gs_data_out(void *pdev, uint8_t epnum)
+{
+	BaseType_t woken = pdFALSE;
+	struct gs_out_frame *o = ring_head(&gs_out);
+	int len;
+
+	/* armed only with room in the ring */
+	len = ((USB_OTG_CORE_HANDLE *)pdev)->dev.out_ep[epnum].xfer_count;
+	memcpy(&o->hf, gs_out_buf,
+	       len < (int)sizeof(o->hf) ? len : (int)sizeof(o->hf));
+	o->len = len;
+	ring_push(&gs_out);
+	gs_out_arm(pdev);
+	if (gs_task)
+		vTaskNotifyGiveFromISR(gs_task, &woken);
+	portEND_SWITCHING_ISR(woken);
+	return USBD_OK;
+}
+
+static uint8_t gs_sof(void *pdev)
+{
+	if (gs_out_nak)
+		gs_out_arm(pdev);
+	gs_in_start(pdev);
+	return USBD_OK;
+}
+
+static uint8_t *gs_get_cfg_desc(uint8_t speed, uint16_t *length)
+{
+	*length = sizeof(gs_cfg_desc);
+	return gs_cfg_desc;
+}
+
+USBD_Class_cb_TypeDef USBD_GS_CAN_cb = {
+	gs_init,
+	gs_deinit,
+	gs_setup,
+	NULL,		/* EP0_TxSent */
+	gs_ep0_rx_ready,
+	gs_data_in,
+	gs_data_out,
+	gs_sof,
+	NULL,
+	NULL,
+	gs_get_cfg_desc,
+#ifdef USE_USB_OTG_HS
+	gs_get_cfg_desc,
+#endif
+};
+
+/* Start an IN transfer now rather than on the next SOF */
+static void gs_in_kick(void)
+{
+#ifdef USE_USB_OTG_HS
+	NVIC_DisableIRQ(OTG_HS_IRQn);
+#else
+	NVIC_DisableIRQ(OTG_FS_IRQn);
+#endif
+	if (gs_pdev)
+		gs_in_start(gs_pdev);
+#ifdef USE_USB_OTG_HS
+	NVIC_EnableIRQ(OTG_HS_IRQn);
+#else
+	NVIC_EnableIRQ(OTG_FS_IRQn);
+#endif
+}
+
+/* CAN TX ISR, or can_xmit_cancel() with `woken` NULL */
+static void gs_tx_done(uint32_t tag, int ok, uint32_t now, BaseType_t *woken)
+{
+	struct gs_tx_done *d = ring_head(&gs_done);
+
+	d->slot = tag;
+	d->ok = ok;
+	d->ts = now;
+	ring_push(&gs_done);
+	if (gs_task)
+		vTaskNotifyGiveFromISR(gs_task, woken);
+}
+
+static int gs_echo_alloc(void)
+{
+	int i;
+
+	for (i = 0; i < GS_ECHO_SLOTS; i++)
+		if (!(gs_echo_busy & (1 << i)))
+			return i;
+	return -1;
+}
+
+/*
+ * Move frames between the bus and the host. TX frames are echoed back
+ * once the controller has sent them, with the completion time as
+ * timestamp: the host releases its TX context on the echo. Frames that
+ * never make it to the bus, cancelled by a mode reset, are not echoed;
+ * the host drops its TX contexts on reset.
+ */
+void task_gs(void *vpars)
+{
+	struct gs_out_frame *o;
+	struct gs_tx_done *d;
+	struct gs_ctrl_req *r;
+	struct can_frame f;
+	uint32_t ir;
+	int dlc, n, slot;
+
+	ring_init(&gs_done);
+	gs_task = xTaskGetCurrentTaskHandle();
+	can_tx_notify(gs_tx_done);
+	can_dump_pkt(0);
+	while (1) {
+		n = 0;
+		while (!ring_empty(&gs_ctrl)) {
+			r = ring_tail(&gs_ctrl);
+			if (gs_ctrl_out(&gs_can, r->req, r->wvalue,
+					r->buf, r->len))
+				gs_ctrl_err = 1;
+			ring_pop(&gs_ctrl);
+		}
+		while (!ring_empty(&gs_done) && !ring_full(&gs_in)) {
+			d = ring_tail(&gs_done);
+			if (d->ok && gs_can.started) {
+				gs_echo[d->slot].timestamp_us = d->ts;
+				*ring_head(&gs_in) = gs_echo[d->slot];
+				ring_push(&gs_in);
+				n++;
+			}
+			gs_echo_busy &= ~(1 << d->slot);
+			ring_pop(&gs_done);
+		}
+		while (!ring_empty(&gs_out)) {
+			o = ring_tail(&gs_out);
+			dlc = gs_frame_decode(&o->hf, o->len, &ir);
+			if (dlc >= 0 && gs_can.started) {
+				/* retry on the next pass */
+				slot = gs_echo_alloc();
+				if (slot < 0)
+					break;
+				gs_frame_encode(&gs_can, &gs_echo[slot],
+						o->hf.echo_id, ir, dlc,
+						o->hf.data, 0);
+				if (can_xmit_tagged(ir, o->hf.data, dlc, slot))
+					break;
+				gs_echo_busy |= 1 << slot;
+			}
+			ring_pop(&gs_out);
+		}
+		while (!ring_full(&gs_in) && !can_recv_frame(&f, 0)) {
+			if (!gs_can.started)
+				continue;
+			gs_frame_encode(&gs_can, ring_head(&gs_in),
+					GS_ECHO_ID_RX, f.ir, CAN_FRAME_DLC(&f),
+					f.data, f.ts);
+			ring_push(&gs_in);
+			n++;
+		}
+		if (n)
+			gs_in_kick();
+		else	/* woken by RX frames and USB transfers alike */
+			ulTaskNotifyTake(pdTRUE, 1);
+	}
+}